@@ -246,31 +246,44 @@ static void do_imgmin(ap_filter_t *f, imgmin_ctx *ctx, imgmin_filter_config *c)
         /*
          * not in cache. generate result and save to cache.
          */
-        MagickWand *tmp;
+        struct imgmin_result res;
         mw = NewMagickWand();
         MagickReadImageBlob(mw, ctx->buffer, ctx->buflen);
-        tmp = search_quality(mw, "-", &c->opt);
-        blob = MagickGetImageBlob(tmp, &bloblen);
-        /* if result is larger than original fall back */
-        if (bloblen > ctx->buflen)
+        search_quality(mw, ctx->buffer, ctx->buflen, 0, &res, &c->opt);
+        blob = res.blob;
+        bloblen = res.size;
+        /* if the image was left alone or the result is larger, fall back to the original */
+        if (!blob || bloblen > ctx->buflen)
         {
             (void) MagickRelinquishMemory(blob);
-            blob = MagickGetImageBlob(mw, &bloblen);
+            blob = AcquireMagickMemory(ctx->buflen);
+            if (blob)
+            {
+                memcpy(blob, ctx->buffer, ctx->buflen);
+            }
+            bloblen = ctx->buflen;
         }
         /*
          * if the results aren't from the cache, write to the cache for later use
          */
-        cache_set(c->cache_dir, path, blob, bloblen);
-        tmp = DestroyMagickWand(tmp);
+        cache_set(c->cache_dir, path, blob ? blob : ctx->buffer, bloblen);
     }
     /*
      *  by this point we've got the contents of our image response in 'blob',
      *  whether it's a cached image, a new response or the original image.
+     *  if there was no memory for it, the original is passed through
+     *  straight from ctx->buffer, which lives as long as the request.
      */
     {
-        apr_bucket *b = apr_bucket_heap_create((char *)blob,
-                                               bloblen, magickfree,
-                                               f->c->bucket_alloc);
+        apr_bucket *b;
+        if (blob)
+        {
+            b = apr_bucket_heap_create((char *)blob, bloblen, magickfree,
+                                       f->c->bucket_alloc);
+        } else {
+            b = apr_bucket_pool_create((char *)ctx->buffer, ctx->buflen,
+                                       f->r->pool, f->c->bucket_alloc);
+        }
         APR_BRIGADE_INSERT_TAIL(ctx->bb, b);
     }
     mw = DestroyMagickWand(mw);
@@ -22,16 +22,38 @@
  */
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <math.h>
 #include <assert.h>
+#include <pthread.h>
 #include "dssim.h"
 
 #ifndef MIN
 #define MIN(a,b) ((a)<=(b)?(a):(b))
 #endif
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DSSIM_X86 1
+#include <immintrin.h>
+#else
+#define DSSIM_X86 0
+#endif
+
 #define MAX_CHANS 3
 
+/*
+ dssim_compare_band() works through the image in bands of at least this many
+ rows, and at most this many bands
+ */
+#define BAND_ROWS_MIN 128
+#define BANDS_MAX 8
+
+/*
+ Levels of the pyramid (see dssim_set_pyramid()) stop before getting smaller than this
+ */
+#define PYRAMID_MIN_SIZE 32
+
 typedef struct {
     float l, A, b, a;
 } laba;
@@ -39,51 +61,270 @@ typedef struct {
 typedef struct {
     int width, height;
     float *img1, *mu1, *sigma1_sq;
-    float *mu2, *sigma2_sq, *sigma12;
+    // dssim_set_compact() keeps img1, mu1 and sigma1_sq in these instead (see pack_channel())
+    uint16_t *img1_16, *mu1_16, *var1_16;
+    float *img2;
 } dssim_info_chan;
 
+/*
+ Scratch memory of one thread. It's kept in dssim_info and only grows, so
+ comparing one modified image after another doesn't allocate (and fault in)
+ full frames of floats each time.
+ */
+typedef struct {
+    float *mem;
+    size_t size;
+} dssim_arena;
+
+typedef struct job_pool job_pool;
+
 struct dssim_info {
     dssim_info_chan chan[MAX_CHANS];
     int channels;
+    int threads;
+    dssim_arena *arenas; // one per thread
+    job_pool *pool; // the helper threads, NULL when there are none; coarser levels share the top one's
+
+    // for converting dssim_rgba, set by dssim_set_original/dssim_set_modified
+    float gamma_lut[256];
+    double gamma;
+
+    // the same images at half the size, and how many more halvings are wanted
+    dssim_info *coarser;
+    int levels;
+
+    int compact;
+
+    // progress of the comparison against the last modified image
+    int next_row;
+    double ssim_sum[MAX_CHANS];
+    float *ssimmap;
 };
 
+static void init_simd(void);
+static job_pool *pool_start(const int helpers);
+static void pool_stop(job_pool *pool);
+
 dssim_info *dssim_init(int channels)
 {
     if (channels != 1 && channels != MAX_CHANS) {
         return NULL;
     }
 
+    init_simd();
+
     dssim_info *inf = calloc(1, sizeof(dssim_info));
     if (inf) {
         inf->channels = channels;
+        inf->threads = 1;
+        inf->arenas = calloc(1, sizeof(inf->arenas[0]));
+        if (!inf->arenas) {
+            free(inf);
+            return NULL;
+        }
     }
     return inf;
 }
 
+/*
+ Before dssim_set_original*(): also keep the images at up to `levels` halvings
+ of the size, for dssim_compare_level(). Each level is the finer one's luma
+ through a 4x4 binomial (Gaussian) filter, then decimated; see pyramid_row().
+ */
+void dssim_set_pyramid(dssim_info *inf, int levels)
+{
+    inf->levels = levels > 0 ? levels : 0;
+}
+
+/*
+ Before dssim_set_original*(): keep the original's image, mean and variance
+ in 16 bits per value instead of 32. Comparisons still blur and sum in floats.
+ */
+void dssim_set_compact(dssim_info *inf, int compact)
+{
+    inf->compact = compact;
+}
+
+/*
+ Gives inf (a single level, not its coarser ones) an arena per thread
+ */
+static int set_arenas(dssim_info *inf, const int threads)
+{
+    dssim_arena *arenas = calloc(threads, sizeof(arenas[0]));
+    if (!arenas) {
+        return 0;
+    }
+    for (int i = 0; i < inf->threads; i++) {
+        free(inf->arenas[i].mem);
+    }
+    free(inf->arenas);
+
+    inf->arenas = arenas;
+    inf->threads = threads;
+    return 1;
+}
+
+/*
+ Number of threads blurs and comparisons are split across. Default 1.
+ The threads are started here and kept until dssim_dealloc(); the pyramid
+ levels use the same ones.
+ */
+void dssim_set_threads(dssim_info *inf, int threads)
+{
+    threads = threads > 1 ? threads : 1;
+
+    pool_stop(inf->pool);
+    inf->pool = NULL;
+    job_pool *pool = threads > 1 ? pool_start(threads - 1) : NULL;
+    if (!pool) {
+        threads = 1;
+    }
+    if (!set_arenas(inf, threads)) {
+        pool_stop(pool);
+        return;
+    }
+    for (dssim_info *level = inf; level; level = level->coarser) {
+        level->pool = level == inf || set_arenas(level, threads) ? pool : NULL;
+    }
+}
+
 void dssim_dealloc(dssim_info *inf)
 {
     for (int ch = 0; ch < inf->channels; ch++) {
-        free(inf->chan[ch].mu2); inf->chan[ch].mu2 = NULL;
-        free(inf->chan[ch].sigma2_sq); inf->chan[ch].sigma2_sq = NULL;
-        free(inf->chan[ch].sigma12); inf->chan[ch].sigma12 = NULL;
+        free(inf->chan[ch].img2); inf->chan[ch].img2 = NULL;
         free(inf->chan[ch].img1); inf->chan[ch].img1 = NULL;
         free(inf->chan[ch].mu1); inf->chan[ch].mu1 = NULL;
         free(inf->chan[ch].sigma1_sq); inf->chan[ch].sigma1_sq = NULL;
+        free(inf->chan[ch].img1_16); inf->chan[ch].img1_16 = NULL;
+        free(inf->chan[ch].mu1_16); inf->chan[ch].mu1_16 = NULL;
+        free(inf->chan[ch].var1_16); inf->chan[ch].var1_16 = NULL;
+    }
+    for (int i = 0; i < inf->threads; i++) {
+        free(inf->arenas[i].mem);
     }
+    free(inf->arenas);
+    if (inf->coarser) {
+        inf->coarser->pool = NULL; // not its own
+        dssim_dealloc(inf->coarser);
+    }
+    pool_stop(inf->pool);
     free(inf);
 }
 
-static double gamma_lut[256];
-static void set_gamma(const double invgamma)
+static float *dup_floats(const float *src, const int n)
+{
+    float *dst = src ? malloc(n * sizeof(float)) : NULL;
+    if (dst) {
+        memcpy(dst, src, n * sizeof(float));
+    }
+    return dst;
+}
+
+static uint16_t *dup_16(const uint16_t *src, const int n)
+{
+    uint16_t *dst = src ? malloc(n * sizeof(uint16_t)) : NULL;
+    if (dst) {
+        memcpy(dst, src, n * sizeof(uint16_t));
+    }
+    return dst;
+}
+
+static dssim_info *clone_level(const dssim_info *inf)
+{
+    dssim_info *copy = dssim_init(inf->channels);
+    if (!copy) {
+        return NULL;
+    }
+
+    memcpy(copy->gamma_lut, inf->gamma_lut, sizeof(copy->gamma_lut));
+    copy->gamma = inf->gamma;
+    copy->levels = inf->levels;
+    copy->compact = inf->compact;
+    int ok = 1;
+    if (inf->coarser) {
+        copy->coarser = clone_level(inf->coarser);
+        ok = copy->coarser != NULL;
+    }
+    for (int ch = 0; ch < inf->channels; ch++) {
+        const dssim_info_chan *src = &inf->chan[ch];
+        dssim_info_chan *dst = &copy->chan[ch];
+        const int n = src->width * src->height;
+        dst->width = src->width;
+        dst->height = src->height;
+        dst->img1 = dup_floats(src->img1, n);
+        dst->mu1 = dup_floats(src->mu1, n);
+        dst->sigma1_sq = dup_floats(src->sigma1_sq, n);
+        dst->img1_16 = dup_16(src->img1_16, n);
+        dst->mu1_16 = dup_16(src->mu1_16, n);
+        dst->var1_16 = dup_16(src->var1_16, n);
+        ok &= !src->img1 == !dst->img1 && !src->mu1 == !dst->mu1 && !src->sigma1_sq == !dst->sigma1_sq &&
+              !src->img1_16 == !dst->img1_16 && !src->mu1_16 == !dst->mu1_16 && !src->var1_16 == !dst->var1_16;
+    }
+    if (!ok) {
+        dssim_dealloc(copy);
+        return NULL;
+    }
+    return copy;
+}
+
+/*
+ Copies the original image set by dssim_set_original*(), so several modified
+ images can be compared against it at the same time (one dssim_info per thread).
+ The copy gets as many threads of its own. NULL if out of memory.
+ */
+dssim_info *dssim_clone(const dssim_info *inf)
+{
+    dssim_info *copy = clone_level(inf);
+    if (copy && inf->threads > 1) {
+        dssim_set_threads(copy, inf->threads);
+    }
+    return copy;
+}
+
+static void set_gamma(dssim_info *inf, const double invgamma)
 {
+    if (inf->gamma == invgamma) {
+        return;
+    }
     for (int i = 0; i < 256; i++) {
-        gamma_lut[i] = pow(i / 255.0, 1.0 / invgamma);
+        inf->gamma_lut[i] = pow(i / 255.0, 1.0 / invgamma);
     }
+    inf->gamma = invgamma;
 }
 
 static const double D65x = 0.9505, D65y = 1.0, D65z = 1.089;
 
-inline static laba rgba_to_laba(const dssim_rgba px)
+/*
+ * Cube root for the Lab conversion, of a positive normal float: x = m * 2^(3q+r)
+ * with m in 0.5..1, so cbrt(x) = cbrt(m) * cbrt(2^r) * 2^q. cbrt(m) from
+ * a quadratic (good to 1e-3) and one Halley step gets it to float precision.
+ * A table with linear interpolation would have to be 4096 entries (16KB) to
+ * be as accurate (256 entries give 5e-7 vs. 2.5e-7 relative error), needs
+ * a gather or one load per lane, and measured no more than ~10% faster on
+ * the cube root alone, which is under a tenth of convert_row's time.
+ */
+static const float cbrt_exp2[3] = {1.f, 1.25992105f, 1.58740105f};
+
+#define CBRT_C0 0.49549930f
+#define CBRT_C1 0.69132629f
+#define CBRT_C2 -0.18732632f
+
+inline static float lab_cbrtf(const float x)
+{
+    union { float f; uint32_t i; } u = {x};
+    const int e = (int)(u.i >> 23) - 126;
+    const int q = (e + 300) / 3 - 100; // rounded down
+    u.i = (u.i & 0x007fffff) | (126u << 23);
+
+    const float m = u.f;
+    u.f = (CBRT_C0 + m * (CBRT_C1 + m * CBRT_C2)) * cbrt_exp2[e - 3*q];
+    u.i += (uint32_t)q << 23;
+
+    const float y = u.f, y3 = y*y*y;
+    return y * (y3 + 2.f * x) / (2.f * y3 + x);
+}
+
+inline static laba rgba_to_laba(const float gamma_lut[], const dssim_rgba px)
 {
     const double r = gamma_lut[px.r],
                  g = gamma_lut[px.g],
@@ -96,9 +337,9 @@ inline static laba rgba_to_laba(const dssim_rgba px)
 
     const double epsilon = 216.0 / 24389.0;
     const double k = (24389.0 / 27.0) / 116.f; // http://www.brucelindbloom.com/LContinuity.html
-    const float X = (fx > epsilon) ? powf(fx, 1.f / 3.f) - 16.f/116.f : k * fx;
-    const float Y = (fy > epsilon) ? powf(fy, 1.f / 3.f) - 16.f/116.f : k * fy;
-    const float Z = (fz > epsilon) ? powf(fz, 1.f / 3.f) - 16.f/116.f : k * fz;
+    const float X = (fx > epsilon) ? lab_cbrtf(fx) - 16.f/116.f : k * fx;
+    const float Y = (fy > epsilon) ? lab_cbrtf(fy) - 16.f/116.f : k * fy;
+    const float Z = (fz > epsilon) ? lab_cbrtf(fz) - 16.f/116.f : k * fz;
 
     return (laba) {
         Y * 1.16f,
@@ -108,27 +349,214 @@ inline static laba rgba_to_laba(const dssim_rgba px)
     };
 }
 
-typedef void rowcallback(float *, const int width);
+/*
+ * Conversion is not reversible
+ */
+inline static laba convert_pixel(const float gamma_lut[], dssim_rgba px, int i, int j)
+{
+    laba f1 = rgba_to_laba(gamma_lut, px);
+    assert(f1.l >= 0.f && f1.l <= 1.0f);
+    assert(f1.A >= 0.f && f1.A <= 1.0f);
+    assert(f1.b >= 0.f && f1.b <= 1.0f);
+    assert(f1.a >= 0.f && f1.a <= 1.0f);
+
+    // Compose image on coloured background to better judge dissimilarity with various backgrounds
+    if (f1.a < 1.0) {
+        f1.l *= f1.a; // using premultiplied alpha
+        f1.A *= f1.a;
+        f1.b *= f1.a;
+
+        int n = i ^ j;
+        if (n & 4) {
+            f1.l += 1.0 - f1.a;
+        }
+        if (n & 8) {
+            f1.A += 1.0 - f1.a;
+        }
+        if (n & 16) {
+            f1.b += 1.0 - f1.a;
+        }
+    }
+
+    return f1;
+}
+
+/*
+ * Converts pixels x0..x1-1 of row y to luma l and, if not NULL, chroma A and b
+ */
+static void convert_pixels(const float gamma_lut[], const dssim_rgba *restrict row,
+                           float *restrict l, float *restrict A, float *restrict b,
+                           const int x0, const int x1, const int y)
+{
+    for (int x = x0; x < x1; x++) {
+        const laba px = convert_pixel(gamma_lut, row[x], x, y);
+        l[x] = px.l;
+        if (A) {
+            A[x] = px.A;
+            b[x] = px.b;
+        }
+    }
+}
+
+static void convert_row_scalar(const float gamma_lut[], const dssim_rgba *restrict row,
+                               float *restrict l, float *restrict A, float *restrict b,
+                               const int width, const int y)
+{
+    convert_pixels(gamma_lut, row, l, A, b, 0, width, y);
+}
+
+#if DSSIM_X86
+/*
+ * convert_row_scalar() a vector of pixels at a time, in floats. Gamma is
+ * looked up one pixel at a time, and pixels that aren't opaque are left to
+ * the scalar code.
+ */
+#define LAB_EPSILON (216.f / 24389.f)
+#define LAB_K ((24389.f / 27.f) / 116.f)
+
+__attribute__((target("sse2")))
+static __m128 lab_cbrt_sse2(const __m128 x)
+{
+    const __m128i bits = _mm_castps_si128(x);
+    const __m128i e = _mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(126));
+    // (e + 300) / 3 - 100; 1/3 rounds up in floats, so exact multiples don't fall short
+    const __m128i q = _mm_sub_epi32(_mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_add_epi32(e, _mm_set1_epi32(300))), _mm_set1_ps(1.f/3.f))), _mm_set1_epi32(100));
+    const __m128i r = _mm_sub_epi32(e, _mm_add_epi32(q, _mm_add_epi32(q, q)));
+    const __m128 m = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x007fffff)), _mm_set1_epi32(126 << 23)));
+
+    const __m128 exp2 = _mm_or_ps(_mm_or_ps(
+        _mm_and_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(r, _mm_setzero_si128())), _mm_set1_ps(cbrt_exp2[0])),
+        _mm_and_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(r, _mm_set1_epi32(1))), _mm_set1_ps(cbrt_exp2[1]))),
+        _mm_and_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(r, _mm_set1_epi32(2))), _mm_set1_ps(cbrt_exp2[2])));
+    __m128 y = _mm_mul_ps(_mm_add_ps(_mm_set1_ps(CBRT_C0), _mm_mul_ps(m, _mm_add_ps(_mm_set1_ps(CBRT_C1), _mm_mul_ps(m, _mm_set1_ps(CBRT_C2))))), exp2);
+    y = _mm_castsi128_ps(_mm_add_epi32(_mm_castps_si128(y), _mm_slli_epi32(q, 23)));
+
+    const __m128 y3 = _mm_mul_ps(_mm_mul_ps(y, y), y);
+    return _mm_div_ps(_mm_mul_ps(y, _mm_add_ps(y3, _mm_add_ps(x, x))), _mm_add_ps(_mm_add_ps(y3, y3), x));
+}
+
+__attribute__((target("sse2")))
+static __m128 lab_f_sse2(const __m128 f)
+{
+    const __m128 above = _mm_cmpgt_ps(f, _mm_set1_ps(LAB_EPSILON));
+    return _mm_or_ps(_mm_and_ps(above, _mm_sub_ps(lab_cbrt_sse2(f), _mm_set1_ps(16.f/116.f))),
+                     _mm_andnot_ps(above, _mm_mul_ps(f, _mm_set1_ps(LAB_K))));
+}
+
+__attribute__((target("sse2")))
+static void convert_row_sse2(const float gamma_lut[], const dssim_rgba *restrict row,
+                             float *restrict l, float *restrict A, float *restrict b,
+                             const int width, const int y)
+{
+    int x = 0;
+    for (; x + 4 <= width; x += 4) {
+        float rl[4], gl[4], bl[4];
+        int opaque = 1;
+        for (int k = 0; k < 4; k++) {
+            rl[k] = gamma_lut[row[x+k].r];
+            gl[k] = gamma_lut[row[x+k].g];
+            bl[k] = gamma_lut[row[x+k].b];
+            opaque &= row[x+k].a == 255;
+        }
+        if (!opaque) {
+            convert_pixels(gamma_lut, row, l, A, b, x, x + 4, y);
+            continue;
+        }
+
+        const __m128 r = _mm_loadu_ps(rl), g = _mm_loadu_ps(gl), bb = _mm_loadu_ps(bl);
+        const __m128 X = lab_f_sse2(_mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(0.4124 / D65x)), _mm_mul_ps(g, _mm_set1_ps(0.3576 / D65x))), _mm_mul_ps(bb, _mm_set1_ps(0.1805 / D65x))));
+        const __m128 Y = lab_f_sse2(_mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(0.2126 / D65y)), _mm_mul_ps(g, _mm_set1_ps(0.7152 / D65y))), _mm_mul_ps(bb, _mm_set1_ps(0.0722 / D65y))));
+
+        _mm_storeu_ps(l + x, _mm_mul_ps(Y, _mm_set1_ps(1.16f)));
+        if (A) {
+            const __m128 Z = lab_f_sse2(_mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(0.0193 / D65z)), _mm_mul_ps(g, _mm_set1_ps(0.1192 / D65z))), _mm_mul_ps(bb, _mm_set1_ps(0.9505 / D65z))));
+            _mm_storeu_ps(A + x, _mm_add_ps(_mm_set1_ps(86.2f/ 220.0f), _mm_mul_ps(_mm_set1_ps(500.0f/ 220.0f), _mm_sub_ps(X, Y))));
+            _mm_storeu_ps(b + x, _mm_add_ps(_mm_set1_ps(107.9f/ 220.0f), _mm_mul_ps(_mm_set1_ps(200.0f/ 220.0f), _mm_sub_ps(Y, Z))));
+        }
+    }
+    convert_pixels(gamma_lut, row, l, A, b, x, width, y);
+}
+
+__attribute__((target("avx2")))
+static __m256 lab_cbrt_avx2(const __m256 x)
+{
+    const __m256i bits = _mm256_castps_si256(x);
+    const __m256i e = _mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(126));
+    const __m256i q = _mm256_sub_epi32(_mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_add_epi32(e, _mm256_set1_epi32(300))), _mm256_set1_ps(1.f/3.f))), _mm256_set1_epi32(100));
+    const __m256i r = _mm256_sub_epi32(e, _mm256_add_epi32(q, _mm256_add_epi32(q, q)));
+    const __m256 m = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x007fffff)), _mm256_set1_epi32(126 << 23)));
+
+    const __m256 exp2 = _mm256_permutevar8x32_ps(_mm256_setr_ps(cbrt_exp2[0], cbrt_exp2[1], cbrt_exp2[2], 0, 0, 0, 0, 0), r);
+    __m256 y = _mm256_mul_ps(_mm256_add_ps(_mm256_set1_ps(CBRT_C0), _mm256_mul_ps(m, _mm256_add_ps(_mm256_set1_ps(CBRT_C1), _mm256_mul_ps(m, _mm256_set1_ps(CBRT_C2))))), exp2);
+    y = _mm256_castsi256_ps(_mm256_add_epi32(_mm256_castps_si256(y), _mm256_slli_epi32(q, 23)));
+
+    const __m256 y3 = _mm256_mul_ps(_mm256_mul_ps(y, y), y);
+    return _mm256_div_ps(_mm256_mul_ps(y, _mm256_add_ps(y3, _mm256_add_ps(x, x))), _mm256_add_ps(_mm256_add_ps(y3, y3), x));
+}
+
+__attribute__((target("avx2")))
+static __m256 lab_f_avx2(const __m256 f)
+{
+    return _mm256_blendv_ps(_mm256_mul_ps(f, _mm256_set1_ps(LAB_K)),
+                            _mm256_sub_ps(lab_cbrt_avx2(f), _mm256_set1_ps(16.f/116.f)),
+                            _mm256_cmp_ps(f, _mm256_set1_ps(LAB_EPSILON), _CMP_GT_OQ));
+}
 
-static void square_row(float *row, const int width)
+__attribute__((target("avx2")))
+static void convert_row_avx2(const float gamma_lut[], const dssim_rgba *restrict row,
+                             float *restrict l, float *restrict A, float *restrict b,
+                             const int width, const int y)
 {
-    for (int i = 0; i < width; i++) {
-        row[i] = row[i] * row[i];
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        const __m256i px = _mm256_loadu_si256((const __m256i *)(row + x));
+        const __m256i byte = _mm256_set1_epi32(0xff);
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(_mm256_srli_epi32(px, 24), byte)) != -1) {
+            convert_pixels(gamma_lut, row, l, A, b, x, x + 8, y);
+            continue;
+        }
+
+        const __m256 r = _mm256_i32gather_ps(gamma_lut, _mm256_and_si256(px, byte), 4);
+        const __m256 g = _mm256_i32gather_ps(gamma_lut, _mm256_and_si256(_mm256_srli_epi32(px, 8), byte), 4);
+        const __m256 bb = _mm256_i32gather_ps(gamma_lut, _mm256_and_si256(_mm256_srli_epi32(px, 16), byte), 4);
+
+        const __m256 X = lab_f_avx2(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(r, _mm256_set1_ps(0.4124 / D65x)), _mm256_mul_ps(g, _mm256_set1_ps(0.3576 / D65x))), _mm256_mul_ps(bb, _mm256_set1_ps(0.1805 / D65x))));
+        const __m256 Y = lab_f_avx2(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(r, _mm256_set1_ps(0.2126 / D65y)), _mm256_mul_ps(g, _mm256_set1_ps(0.7152 / D65y))), _mm256_mul_ps(bb, _mm256_set1_ps(0.0722 / D65y))));
+
+        _mm256_storeu_ps(l + x, _mm256_mul_ps(Y, _mm256_set1_ps(1.16f)));
+        if (A) {
+            const __m256 Z = lab_f_avx2(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(r, _mm256_set1_ps(0.0193 / D65z)), _mm256_mul_ps(g, _mm256_set1_ps(0.1192 / D65z))), _mm256_mul_ps(bb, _mm256_set1_ps(0.9505 / D65z))));
+            _mm256_storeu_ps(A + x, _mm256_add_ps(_mm256_set1_ps(86.2f/ 220.0f), _mm256_mul_ps(_mm256_set1_ps(500.0f/ 220.0f), _mm256_sub_ps(X, Y))));
+            _mm256_storeu_ps(b + x, _mm256_add_ps(_mm256_set1_ps(107.9f/ 220.0f), _mm256_mul_ps(_mm256_set1_ps(200.0f/ 220.0f), _mm256_sub_ps(Y, Z))));
+        }
     }
+    convert_pixels(gamma_lut, row, l, A, b, x, width, y);
 }
+#endif
+
+/*
+ * Rows the transposing blur works on together. Each column of a tile is then
+ * written as BLUR_TILE consecutive floats (a 64-byte cache line) instead of
+ * one float per line, and the rows are read as that many sequential streams.
+ */
+#define BLUR_TILE 16
 
 /*
- * Blurs image horizontally (width 2*size+1) and writes it transposed to dst
- * (called twice gives 2d blur)
- * Callback is executed on every row before blurring
+ * Floats of scratch memory the blurs need for an image of width x height
  */
-static void transposing_1d_blur(float *restrict src, float *restrict dst, const int width, const int height)
+#define BLUR_SCRATCH(width, height) (2 * BLUR_TILE * (size_t)((width) > (height) ? (width) : (height)))
+
+/*
+ * Blurs rows j0..j1-1 of the image horizontally (width 2*size) and writes them
+ * transposed to dst (called twice gives 2d blur)
+ */
+static void transposing_1d_blur_rows(const float *restrict src, float *restrict dst, const int width, const int height, const int j0, const int j1)
 {
     const int size = 4;
     const float sizef = size;
 
-    for (int j = 0; j < height; j++) {
-        float *restrict row = src + j * width;
+    for (int j = j0; j < j1; j++) {
+        const float *restrict row = src + j * width;
 
         // accumulate sum for pixels outside line
         float sum = 0;
@@ -166,8 +594,67 @@ static void transposing_1d_blur(float *restrict src, float *restrict dst, const
     }
 }
 
-static void regular_1d_blur(float *restrict src, float *restrict dst, const int width, const int height, rowcallback *const callback)
+/*
+ * transposing_1d_blur_rows() for the BLUR_TILE rows from j, side by side
+ */
+static void transposing_1d_blur_tile(const float *restrict src, float *restrict dst, const int width, const int height, const int j)
+{
+    const int size = 4;
+    const float sizef = size;
+    const float *restrict rows = src + j * width;
+    float sum[BLUR_TILE];
+
+    for (int l = 0; l < BLUR_TILE; l++) {
+        sum[l] = rows[l*width] * sizef;
+    }
+    for(int i=0; i < MIN(width,size); i++) {
+        for (int l = 0; l < BLUR_TILE; l++) {
+            sum[l] += rows[l*width + i];
+        }
+    }
+
+    for(int i=0; i < MIN(width,size); i++) {
+        for (int l = 0; l < BLUR_TILE; l++) {
+            sum[l] -= rows[l*width];
+            if((i + size) < width){
+                sum[l] += rows[l*width + i+size];
+            }
+            dst[i*height + j + l] = sum[l] / (sizef * 2.0f);
+        }
+    }
+
+    for(int i=size; i < width-size; i++) {
+        for (int l = 0; l < BLUR_TILE; l++) {
+            sum[l] -= rows[l*width + i-size];
+            sum[l] += rows[l*width + i+size];
+            dst[i*height + j + l] = sum[l] / (sizef * 2.0f);
+        }
+    }
+
+    for(int i=width-size; i < width; i++) {
+        for (int l = 0; l < BLUR_TILE; l++) {
+            if(i-size >= 0){
+                sum[l] -= rows[l*width + i-size];
+            }
+            sum[l] += rows[l*width + width-1];
+            dst[i*height + j + l] = sum[l] / (sizef * 2.0f);
+        }
+    }
+}
+
+static void transposing_1d_blur_scalar(float *restrict src, float *restrict dst, const int width, const int height, float *restrict scratch)
+{
+    (void)scratch; // only the SIMD versions need it
+    int j = 0;
+    for (; j + BLUR_TILE <= height; j += BLUR_TILE) {
+        transposing_1d_blur_tile(src, dst, width, height, j);
+    }
+    transposing_1d_blur_rows(src, dst, width, height, j, height);
+}
+
+static void regular_1d_blur_scalar(float *restrict src, float *restrict dst, const int width, const int height, float *restrict scratch)
 {
+    (void)scratch; // only the SIMD versions need it
     const int size = 1;
     const float sizef = size;
 
@@ -175,9 +662,6 @@ static void regular_1d_blur(float *restrict src, float *restrict dst, const int
         float *restrict row = src + j*width;
         float *restrict dstrow = dst + j*width;
 
-        // preprocess line
-        if (callback) callback(row,width);
-
         // accumulate sum for pixels outside line
         float sum = 0;
         sum = row[0] * sizef;
@@ -214,162 +698,1023 @@ static void regular_1d_blur(float *restrict src, float *restrict dst, const int
     }
 }
 
-
+#if DSSIM_X86
 /*
- * Filters image with callback and blurs (lousy approximate of gaussian)
+ * SIMD versions of the blurs. They work on tiles of BLUR_TILE rows, one row
+ * per lane: the rows are transposed into a buffer through registers (4x4 or
+ * 8x8 blocks) so that each column of the tile is BLUR_TILE consecutive floats,
+ * and then go through exactly the same sliding sum, in the same order, as the
+ * scalar code. Results are bit-identical.
+ * Rows left over at the bottom go through the scalar code.
  */
-static void blur(float *restrict src, float *restrict tmp, float *restrict dst,
-                 const int width, const int height, rowcallback *const callback, int extrablur)
+
+/* t[i*BLUR_TILE + l] = rows[l*stride + i] for 4 rows */
+__attribute__((target("sse2")))
+static void transpose_in_sse2(const float *restrict rows, float *restrict t, const int width, const int stride)
 {
-    regular_1d_blur(src, tmp, width, height, callback);
-    regular_1d_blur(tmp, dst, width, height, NULL);
-    if (extrablur) {
-        transposing_1d_blur(dst, tmp, width, height);
-        transposing_1d_blur(tmp, dst, width, height);
+    int i = 0;
+    for (; i + 4 <= width; i += 4) {
+        __m128 r0 = _mm_loadu_ps(rows + i);
+        __m128 r1 = _mm_loadu_ps(rows + stride + i);
+        __m128 r2 = _mm_loadu_ps(rows + 2*stride + i);
+        __m128 r3 = _mm_loadu_ps(rows + 3*stride + i);
+        _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+        _mm_storeu_ps(t + i*BLUR_TILE, r0);
+        _mm_storeu_ps(t + (i+1)*BLUR_TILE, r1);
+        _mm_storeu_ps(t + (i+2)*BLUR_TILE, r2);
+        _mm_storeu_ps(t + (i+3)*BLUR_TILE, r3);
     }
-    transposing_1d_blur(dst, tmp, width, height);
-    if (extrablur) {
-        regular_1d_blur(tmp, dst, height, width, NULL);
-        regular_1d_blur(dst, tmp, height, width, NULL);
-        regular_1d_blur(tmp, dst, height, width, NULL);
-        regular_1d_blur(dst, tmp, height, width, NULL);
+    for (; i < width; i++) {
+        for (int l = 0; l < 4; l++) {
+            t[i*BLUR_TILE + l] = rows[l*stride + i];
+        }
     }
-    regular_1d_blur(tmp, dst, height, width, NULL);
-    regular_1d_blur(dst, tmp, height, width, NULL);
-    transposing_1d_blur(tmp, dst, height, width);
 }
 
-/*
- * Conversion is not reversible
- */
-inline static laba convert_pixel(dssim_rgba px, int i, int j)
+/* rows[l*stride + i] = t[i*BLUR_TILE + l] for 4 rows */
+__attribute__((target("sse2")))
+static void transpose_out_sse2(const float *restrict t, float *restrict rows, const int width, const int stride)
 {
-    laba f1 = rgba_to_laba(px);
-    assert(f1.l >= 0.f && f1.l <= 1.0f);
-    assert(f1.A >= 0.f && f1.A <= 1.0f);
-    assert(f1.b >= 0.f && f1.b <= 1.0f);
-    assert(f1.a >= 0.f && f1.a <= 1.0f);
-
-    // Compose image on coloured background to better judge dissimilarity with various backgrounds
-    if (f1.a < 1.0) {
-        f1.l *= f1.a; // using premultiplied alpha
-        f1.A *= f1.a;
-        f1.b *= f1.a;
-
-        int n = i ^ j;
-        if (n & 4) {
-            f1.l += 1.0 - f1.a;
-        }
-        if (n & 8) {
-            f1.A += 1.0 - f1.a;
-        }
-        if (n & 16) {
-            f1.b += 1.0 - f1.a;
+    int i = 0;
+    for (; i + 4 <= width; i += 4) {
+        __m128 r0 = _mm_loadu_ps(t + i*BLUR_TILE);
+        __m128 r1 = _mm_loadu_ps(t + (i+1)*BLUR_TILE);
+        __m128 r2 = _mm_loadu_ps(t + (i+2)*BLUR_TILE);
+        __m128 r3 = _mm_loadu_ps(t + (i+3)*BLUR_TILE);
+        _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+        _mm_storeu_ps(rows + i, r0);
+        _mm_storeu_ps(rows + stride + i, r1);
+        _mm_storeu_ps(rows + 2*stride + i, r2);
+        _mm_storeu_ps(rows + 3*stride + i, r3);
+    }
+    for (; i < width; i++) {
+        for (int l = 0; l < 4; l++) {
+            rows[l*stride + i] = t[i*BLUR_TILE + l];
         }
     }
-
-    return f1;
 }
 
-static void convert_image(const dssim_info *inf, float *restrict chans[], dssim_row_callback cb, void *callback_user_data)
+/* the scalar sliding sum over a transposed tile, see regular_1d_blur_scalar() */
+__attribute__((target("sse2")))
+static void sliding_sum_sse2(const float *restrict t, float *restrict out, const int out_stride, const int width, const int size)
 {
-    const int width = inf->chan[0].width;
-    const int height = inf->chan[0].height;
-    float *row_tmp[inf->channels];
-
-    for(int ch = 1; ch < inf->channels; ch++) {
-        row_tmp[ch] = calloc(width, sizeof(float)); // for the callback all channels have the same width!
+    enum { N = BLUR_TILE / 4 };
+    const __m128 sizef = _mm_set1_ps(size);
+    const __m128 scale = _mm_set1_ps(1.f / (size * 2.0f)); // power of 2, same as dividing
+    const float *restrict last = t + (width-1)*BLUR_TILE;
+    __m128 sum[N];
+
+    for (int v = 0; v < N; v++) {
+        sum[v] = _mm_mul_ps(_mm_loadu_ps(t + v*4), sizef);
+    }
+    for(int i=0; i < MIN(width,size); i++) {
+        for (int v = 0; v < N; v++) {
+            sum[v] = _mm_add_ps(sum[v], _mm_loadu_ps(t + i*BLUR_TILE + v*4));
+        }
     }
 
-    for(int y = 0; y < height; y++) {
-        row_tmp[0] = &chans[0][width * y]; // Luma can be written directly (it's unscaled)
-
-        cb(inf, row_tmp, inf->channels, y, width, callback_user_data);
+    for(int i=0; i < MIN(width,size); i++) {
+        for (int v = 0; v < N; v++) {
+            sum[v] = _mm_sub_ps(sum[v], _mm_loadu_ps(t + v*4));
+            if ((i + size) < width) {
+                sum[v] = _mm_add_ps(sum[v], _mm_loadu_ps(t + (i+size)*BLUR_TILE + v*4));
+            }
+            _mm_storeu_ps(out + i*out_stride + v*4, _mm_mul_ps(sum[v], scale));
+        }
+    }
 
-        for(int ch = 1; ch < inf->channels; ch++) { // Chroma is downsampled
-            const int halfy = y * inf->chan[ch].height / height;
-            float *dstrow = &chans[ch][halfy * inf->chan[ch].width];
+    for (int i = size; i < width - size; i++) {
+        for (int v = 0; v < N; v++) {
+            sum[v] = _mm_sub_ps(sum[v], _mm_loadu_ps(t + (i-size)*BLUR_TILE + v*4));
+            sum[v] = _mm_add_ps(sum[v], _mm_loadu_ps(t + (i+size)*BLUR_TILE + v*4));
+            _mm_storeu_ps(out + i*out_stride + v*4, _mm_mul_ps(sum[v], scale));
+        }
+    }
 
-            for(int x = 0; x < width; x++) {
-                dstrow[x/2] += row_tmp[ch][x] * 0.25f;
+    for (int i = width - size; i < width; i++) {
+        for (int v = 0; v < N; v++) {
+            if (i - size >= 0) {
+                sum[v] = _mm_sub_ps(sum[v], _mm_loadu_ps(t + (i-size)*BLUR_TILE + v*4));
             }
+            sum[v] = _mm_add_ps(sum[v], _mm_loadu_ps(last + v*4));
+            _mm_storeu_ps(out + i*out_stride + v*4, _mm_mul_ps(sum[v], scale));
         }
     }
+}
 
-    for(int ch = 1; ch < inf->channels; ch++) {
-        free(row_tmp[ch]);
+__attribute__((target("sse2")))
+static void regular_1d_blur_sse2(float *restrict src, float *restrict dst, const int width, const int height, float *restrict scratch)
+{
+    float *restrict t = scratch;
+    float *restrict u = scratch + width * BLUR_TILE;
+    int j = 0;
+
+    for (; j + BLUR_TILE <= height; j += BLUR_TILE) {
+        for (int l = 0; l < BLUR_TILE; l += 4) {
+            transpose_in_sse2(src + (j+l)*width, t + l, width, width);
+        }
+        sliding_sum_sse2(t, u, BLUR_TILE, width, 1);
+        for (int l = 0; l < BLUR_TILE; l += 4) {
+            transpose_out_sse2(u + l, dst + (j+l)*width, width, width);
+        }
     }
+    regular_1d_blur_scalar(src + j*width, dst + j*width, width, height - j, NULL);
 }
 
-static void convert_image_row(const dssim_info *const inf, float *const channels[], const int num_channels, const int y, const int width, void *user_data)
+__attribute__((target("sse2")))
+static void transposing_1d_blur_sse2(float *restrict src, float *restrict dst, const int width, const int height, float *restrict scratch)
 {
-    dssim_rgba *const row = ((dssim_rgba **)user_data)[y];
+    float *restrict t = scratch;
+    int j = 0;
 
-    for (int x = 0; x < width; x++) {
-        laba px = convert_pixel(row[x], x, y);
-        channels[0][x] = px.l;
-        if (num_channels >= 3) {
-            channels[1][x] = px.A;
-            channels[2][x] = px.b;
+    for (; j + BLUR_TILE <= height; j += BLUR_TILE) {
+        for (int l = 0; l < BLUR_TILE; l += 4) {
+            transpose_in_sse2(src + (j+l)*width, t + l, width, width);
         }
+        sliding_sum_sse2(t, dst + j, height, width, 4);
     }
+    transposing_1d_blur_rows(src, dst, width, height, j, height);
 }
 
-/*
- Can be called only once. Copies the image.
- */
-void dssim_set_original(dssim_info *inf, dssim_rgba *row_pointers[], const int width, const int height, double gamma)
+__attribute__((target("avx2")))
+static void transpose8_avx2(__m256 r[8])
 {
-    set_gamma(gamma);
-    dssim_set_original_float_callback(inf, width, height, convert_image_row, (void*)row_pointers);
+    const __m256 t0 = _mm256_unpacklo_ps(r[0], r[1]), t1 = _mm256_unpackhi_ps(r[0], r[1]);
+    const __m256 t2 = _mm256_unpacklo_ps(r[2], r[3]), t3 = _mm256_unpackhi_ps(r[2], r[3]);
+    const __m256 t4 = _mm256_unpacklo_ps(r[4], r[5]), t5 = _mm256_unpackhi_ps(r[4], r[5]);
+    const __m256 t6 = _mm256_unpacklo_ps(r[6], r[7]), t7 = _mm256_unpackhi_ps(r[6], r[7]);
+    const __m256 s0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1,0,1,0)), s1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3,2,3,2));
+    const __m256 s2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1,0,1,0)), s3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3,2,3,2));
+    const __m256 s4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1,0,1,0)), s5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3,2,3,2));
+    const __m256 s6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1,0,1,0)), s7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3,2,3,2));
+    r[0] = _mm256_permute2f128_ps(s0, s4, 0x20);
+    r[1] = _mm256_permute2f128_ps(s1, s5, 0x20);
+    r[2] = _mm256_permute2f128_ps(s2, s6, 0x20);
+    r[3] = _mm256_permute2f128_ps(s3, s7, 0x20);
+    r[4] = _mm256_permute2f128_ps(s0, s4, 0x31);
+    r[5] = _mm256_permute2f128_ps(s1, s5, 0x31);
+    r[6] = _mm256_permute2f128_ps(s2, s6, 0x31);
+    r[7] = _mm256_permute2f128_ps(s3, s7, 0x31);
 }
 
-void dssim_set_original_float_callback(dssim_info *inf, const int width, const int height, dssim_row_callback cb, void *callback_user_data)
+/* t[i*BLUR_TILE + l] = rows[l*stride + i] for 8 rows */
+__attribute__((target("avx2")))
+static void transpose_in_avx2(const float *restrict rows, float *restrict t, const int width, const int stride)
+{
+    int i = 0;
+    for (; i + 8 <= width; i += 8) {
+        __m256 r[8];
+        for (int l = 0; l < 8; l++) {
+            r[l] = _mm256_loadu_ps(rows + l*stride + i);
+        }
+        transpose8_avx2(r);
+        for (int l = 0; l < 8; l++) {
+            _mm256_storeu_ps(t + (i+l)*BLUR_TILE, r[l]);
+        }
+    }
+    for (; i < width; i++) {
+        for (int l = 0; l < 8; l++) {
+            t[i*BLUR_TILE + l] = rows[l*stride + i];
+        }
+    }
+}
+
+/* rows[l*stride + i] = t[i*BLUR_TILE + l] for 8 rows */
+__attribute__((target("avx2")))
+static void transpose_out_avx2(const float *restrict t, float *restrict rows, const int width, const int stride)
+{
+    int i = 0;
+    for (; i + 8 <= width; i += 8) {
+        __m256 r[8];
+        for (int l = 0; l < 8; l++) {
+            r[l] = _mm256_loadu_ps(t + (i+l)*BLUR_TILE);
+        }
+        transpose8_avx2(r);
+        for (int l = 0; l < 8; l++) {
+            _mm256_storeu_ps(rows + l*stride + i, r[l]);
+        }
+    }
+    for (; i < width; i++) {
+        for (int l = 0; l < 8; l++) {
+            rows[l*stride + i] = t[i*BLUR_TILE + l];
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static void sliding_sum_avx2(const float *restrict t, float *restrict out, const int out_stride, const int width, const int size)
+{
+    enum { N = BLUR_TILE / 8 };
+    const __m256 sizef = _mm256_set1_ps(size);
+    const __m256 scale = _mm256_set1_ps(1.f / (size * 2.0f));
+    const float *restrict last = t + (width-1)*BLUR_TILE;
+    __m256 sum[N];
+
+    for (int v = 0; v < N; v++) {
+        sum[v] = _mm256_mul_ps(_mm256_loadu_ps(t + v*8), sizef);
+    }
+    for(int i=0; i < MIN(width,size); i++) {
+        for (int v = 0; v < N; v++) {
+            sum[v] = _mm256_add_ps(sum[v], _mm256_loadu_ps(t + i*BLUR_TILE + v*8));
+        }
+    }
+
+    for(int i=0; i < MIN(width,size); i++) {
+        for (int v = 0; v < N; v++) {
+            sum[v] = _mm256_sub_ps(sum[v], _mm256_loadu_ps(t + v*8));
+            if ((i + size) < width) {
+                sum[v] = _mm256_add_ps(sum[v], _mm256_loadu_ps(t + (i+size)*BLUR_TILE + v*8));
+            }
+            _mm256_storeu_ps(out + i*out_stride + v*8, _mm256_mul_ps(sum[v], scale));
+        }
+    }
+
+    for (int i = size; i < width - size; i++) {
+        for (int v = 0; v < N; v++) {
+            sum[v] = _mm256_sub_ps(sum[v], _mm256_loadu_ps(t + (i-size)*BLUR_TILE + v*8));
+            sum[v] = _mm256_add_ps(sum[v], _mm256_loadu_ps(t + (i+size)*BLUR_TILE + v*8));
+            _mm256_storeu_ps(out + i*out_stride + v*8, _mm256_mul_ps(sum[v], scale));
+        }
+    }
+
+    for (int i = width - size; i < width; i++) {
+        for (int v = 0; v < N; v++) {
+            if (i - size >= 0) {
+                sum[v] = _mm256_sub_ps(sum[v], _mm256_loadu_ps(t + (i-size)*BLUR_TILE + v*8));
+            }
+            sum[v] = _mm256_add_ps(sum[v], _mm256_loadu_ps(last + v*8));
+            _mm256_storeu_ps(out + i*out_stride + v*8, _mm256_mul_ps(sum[v], scale));
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static void regular_1d_blur_avx2(float *restrict src, float *restrict dst, const int width, const int height, float *restrict scratch)
+{
+    float *restrict t = scratch;
+    float *restrict u = scratch + width * BLUR_TILE;
+    int j = 0;
+
+    for (; j + BLUR_TILE <= height; j += BLUR_TILE) {
+        for (int l = 0; l < BLUR_TILE; l += 8) {
+            transpose_in_avx2(src + (j+l)*width, t + l, width, width);
+        }
+        sliding_sum_avx2(t, u, BLUR_TILE, width, 1);
+        for (int l = 0; l < BLUR_TILE; l += 8) {
+            transpose_out_avx2(u + l, dst + (j+l)*width, width, width);
+        }
+    }
+    regular_1d_blur_scalar(src + j*width, dst + j*width, width, height - j, NULL);
+}
+
+__attribute__((target("avx2")))
+static void transposing_1d_blur_avx2(float *restrict src, float *restrict dst, const int width, const int height, float *restrict scratch)
+{
+    float *restrict t = scratch;
+    int j = 0;
+
+    for (; j + BLUR_TILE <= height; j += BLUR_TILE) {
+        for (int l = 0; l < BLUR_TILE; l += 8) {
+            transpose_in_avx2(src + (j+l)*width, t + l, width, width);
+        }
+        sliding_sum_avx2(t, dst + j, height, width, 4);
+    }
+    transposing_1d_blur_rows(src, dst, width, height, j, height);
+}
+#endif
+
+/*
+ * Adds SSIM of a row of pixels to ssim_sum, and writes it to ssimmap if not NULL
+ */
+static double ssim_row(double ssim_sum, const float *restrict mu1, const float *restrict sigma1_sq,
+                       const float *restrict mu2, const float *restrict sigma2_sq, const float *restrict sigma12,
+                       const int width, float *restrict ssimmap)
+{
+    const double c1 = 0.01 * 0.01, c2 = 0.03 * 0.03;
+
+    for (int x = 0; x < width; x++) {
+        const double mu1_sq = mu1[x]*mu1[x];
+        const double mu2_sq = mu2[x]*mu2[x];
+        const double mu1mu2 = mu1[x]*mu2[x];
+
+        const double ssim = (c1 + 2.0 * mu1mu2) * (c2 + 2.0 * (sigma12[x] - mu1mu2))
+                            /
+                            ((c1 + mu1_sq + mu2_sq) * (c2 + sigma1_sq[x] - mu1_sq + sigma2_sq[x] - mu2_sq));
+
+        ssim_sum += ssim;
+
+        if (ssimmap) {
+            ssimmap[x] = ssim;
+        }
+    }
+    return ssim_sum;
+}
+
+
+#if DSSIM_X86
+/*
+ * ssim_row() without the map, in floats. Each lane keeps a Kahan-compensated
+ * sum over the row, and the row's total goes into the double ssim_sum, so it
+ * stays within float rounding of each pixel's SSIM of the double version.
+ */
+__attribute__((target("sse2")))
+static double ssim_row_sum_sse2(double ssim_sum, const float *restrict mu1, const float *restrict sigma1_sq,
+                                const float *restrict mu2, const float *restrict sigma2_sq, const float *restrict sigma12,
+                                const int width)
+{
+    const __m128 c1 = _mm_set1_ps(0.01f * 0.01f), c2 = _mm_set1_ps(0.03f * 0.03f), two = _mm_set1_ps(2.f);
+    __m128 sum = _mm_setzero_ps(), err = _mm_setzero_ps();
+    int x = 0;
+
+    for (; x + 4 <= width; x += 4) {
+        const __m128 m1 = _mm_loadu_ps(mu1 + x), m2 = _mm_loadu_ps(mu2 + x);
+        const __m128 mu1_sq = _mm_mul_ps(m1, m1);
+        const __m128 mu2_sq = _mm_mul_ps(m2, m2);
+        const __m128 mu1mu2 = _mm_mul_ps(m1, m2);
+
+        const __m128 num = _mm_mul_ps(_mm_add_ps(c1, _mm_mul_ps(two, mu1mu2)),
+                                      _mm_add_ps(c2, _mm_mul_ps(two, _mm_sub_ps(_mm_loadu_ps(sigma12 + x), mu1mu2))));
+        // variances before adding c2, where the subtractions are exact in floats too
+        const __m128 var1 = _mm_sub_ps(_mm_loadu_ps(sigma1_sq + x), mu1_sq);
+        const __m128 var2 = _mm_sub_ps(_mm_loadu_ps(sigma2_sq + x), mu2_sq);
+        const __m128 den = _mm_mul_ps(_mm_add_ps(_mm_add_ps(c1, mu1_sq), mu2_sq),
+                                      _mm_add_ps(_mm_add_ps(c2, var1), var2));
+
+        const __m128 y = _mm_sub_ps(_mm_div_ps(num, den), err);
+        const __m128 t = _mm_add_ps(sum, y);
+        err = _mm_sub_ps(_mm_sub_ps(t, sum), y);
+        sum = t;
+    }
+
+    float lanes[4], lane_err[4];
+    _mm_storeu_ps(lanes, sum);
+    _mm_storeu_ps(lane_err, err);
+    for (int l = 0; l < 4; l++) {
+        ssim_sum += (double)lanes[l] - (double)lane_err[l];
+    }
+
+    return ssim_row(ssim_sum, mu1 + x, sigma1_sq + x, mu2 + x, sigma2_sq + x, sigma12 + x, width - x, NULL);
+}
+
+__attribute__((target("avx2")))
+static double ssim_row_sum_avx2(double ssim_sum, const float *restrict mu1, const float *restrict sigma1_sq,
+                                const float *restrict mu2, const float *restrict sigma2_sq, const float *restrict sigma12,
+                                const int width)
+{
+    const __m256 c1 = _mm256_set1_ps(0.01f * 0.01f), c2 = _mm256_set1_ps(0.03f * 0.03f), two = _mm256_set1_ps(2.f);
+    __m256 sum = _mm256_setzero_ps(), err = _mm256_setzero_ps();
+    int x = 0;
+
+    for (; x + 8 <= width; x += 8) {
+        const __m256 m1 = _mm256_loadu_ps(mu1 + x), m2 = _mm256_loadu_ps(mu2 + x);
+        const __m256 mu1_sq = _mm256_mul_ps(m1, m1);
+        const __m256 mu2_sq = _mm256_mul_ps(m2, m2);
+        const __m256 mu1mu2 = _mm256_mul_ps(m1, m2);
+
+        const __m256 num = _mm256_mul_ps(_mm256_add_ps(c1, _mm256_mul_ps(two, mu1mu2)),
+                                         _mm256_add_ps(c2, _mm256_mul_ps(two, _mm256_sub_ps(_mm256_loadu_ps(sigma12 + x), mu1mu2))));
+        // variances before adding c2, where the subtractions are exact in floats too
+        const __m256 var1 = _mm256_sub_ps(_mm256_loadu_ps(sigma1_sq + x), mu1_sq);
+        const __m256 var2 = _mm256_sub_ps(_mm256_loadu_ps(sigma2_sq + x), mu2_sq);
+        const __m256 den = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(c1, mu1_sq), mu2_sq),
+                                         _mm256_add_ps(_mm256_add_ps(c2, var1), var2));
+
+        const __m256 y = _mm256_sub_ps(_mm256_div_ps(num, den), err);
+        const __m256 t = _mm256_add_ps(sum, y);
+        err = _mm256_sub_ps(_mm256_sub_ps(t, sum), y);
+        sum = t;
+    }
+
+    float lanes[8], lane_err[8];
+    _mm256_storeu_ps(lanes, sum);
+    _mm256_storeu_ps(lane_err, err);
+    for (int l = 0; l < 8; l++) {
+        ssim_sum += (double)lanes[l] - (double)lane_err[l];
+    }
+
+    return ssim_row(ssim_sum, mu1 + x, sigma1_sq + x, mu2 + x, sigma2_sq + x, sigma12 + x, width - x, NULL);
+}
+#endif
+
+static double ssim_row_sum_scalar(double ssim_sum, const float *restrict mu1, const float *restrict sigma1_sq,
+                                  const float *restrict mu2, const float *restrict sigma2_sq, const float *restrict sigma12,
+                                  const int width)
+{
+    return ssim_row(ssim_sum, mu1, sigma1_sq, mu2, sigma2_sq, sigma12, width, NULL);
+}
+
+/*
+ * scratch is BLUR_SCRATCH(width, height) floats the SIMD versions work in
+ */
+typedef void blurfunc(float *restrict src, float *restrict dst, const int width, const int height, float *restrict scratch);
+
+typedef double ssimfunc(double ssim_sum, const float *restrict mu1, const float *restrict sigma1_sq,
+                        const float *restrict mu2, const float *restrict sigma2_sq, const float *restrict sigma12,
+                        const int width);
+
+typedef void convertfunc(const float gamma_lut[], const dssim_rgba *restrict row,
+                         float *restrict l, float *restrict A, float *restrict b,
+                         const int width, const int y);
+
+// the fastest versions the CPU runs (or those dssim_set_kernels() asked for), picked by init_simd()
+static blurfunc *regular_1d_blur = regular_1d_blur_scalar;
+static blurfunc *transposing_1d_blur = transposing_1d_blur_scalar;
+static ssimfunc *ssim_row_sum = ssim_row_sum_scalar;
+static convertfunc *convert_row = convert_row_scalar;
+static int kernels = DSSIM_KERNELS_BEST;
+
+static int cpu_runs(const int k)
+{
+#if DSSIM_X86
+    __builtin_cpu_init();
+    return k == DSSIM_KERNELS_SCALAR ||
+           (k == DSSIM_KERNELS_SSE2 && __builtin_cpu_supports("sse2")) ||
+           (k == DSSIM_KERNELS_AVX2 && __builtin_cpu_supports("avx2"));
+#else
+    return k == DSSIM_KERNELS_SCALAR;
+#endif
+}
+
+/*
+ * Every pointer is assigned once, so comparisons already running on other
+ * threads never see a different kernel when another dssim_init() calls this.
+ */
+static void init_simd(void)
+{
+    int k = kernels;
+    if (k == DSSIM_KERNELS_BEST) {
+        k = cpu_runs(DSSIM_KERNELS_AVX2) ? DSSIM_KERNELS_AVX2 :
+            cpu_runs(DSSIM_KERNELS_SSE2) ? DSSIM_KERNELS_SSE2 : DSSIM_KERNELS_SCALAR;
+    }
+#if DSSIM_X86
+    if (k == DSSIM_KERNELS_AVX2) {
+        regular_1d_blur = regular_1d_blur_avx2;
+        transposing_1d_blur = transposing_1d_blur_avx2;
+        ssim_row_sum = ssim_row_sum_avx2;
+        convert_row = convert_row_avx2;
+        return;
+    }
+    if (k == DSSIM_KERNELS_SSE2) {
+        regular_1d_blur = regular_1d_blur_sse2;
+        transposing_1d_blur = transposing_1d_blur_sse2;
+        ssim_row_sum = ssim_row_sum_sse2;
+        convert_row = convert_row_sse2;
+        return;
+    }
+#endif
+    regular_1d_blur = regular_1d_blur_scalar;
+    transposing_1d_blur = transposing_1d_blur_scalar;
+    ssim_row_sum = ssim_row_sum_scalar;
+    convert_row = convert_row_scalar;
+}
+
+/*
+ Picks the kernels for every dssim_info; 0 if the CPU can't run them
+ */
+int dssim_set_kernels(int k)
+{
+    if (k != DSSIM_KERNELS_BEST && !cpu_runs(k)) {
+        return 0;
+    }
+    kernels = k;
+    init_simd();
+    return 1;
+}
+
+/*
+ * blur() after its first horizontal pass, which has been done into tmp.
+ * tmp is overwritten.
+ */
+static void blur_rest(float *restrict tmp, float *restrict dst,
+                      const int width, const int height, int extrablur, float *restrict scratch)
+{
+    regular_1d_blur(tmp, dst, width, height, scratch);
+    if (extrablur) {
+        transposing_1d_blur(dst, tmp, width, height, scratch);
+        transposing_1d_blur(tmp, dst, height, width, scratch);
+    }
+    transposing_1d_blur(dst, tmp, width, height, scratch);
+    if (extrablur) {
+        regular_1d_blur(tmp, dst, height, width, scratch);
+        regular_1d_blur(dst, tmp, height, width, scratch);
+        regular_1d_blur(tmp, dst, height, width, scratch);
+        regular_1d_blur(dst, tmp, height, width, scratch);
+    }
+    regular_1d_blur(tmp, dst, height, width, scratch);
+    regular_1d_blur(dst, tmp, height, width, scratch);
+    transposing_1d_blur(tmp, dst, height, width, scratch);
+}
+
+/*
+ * Blurs image (lousy approximate of gaussian)
+ */
+static void blur(float *restrict src, float *restrict tmp, float *restrict dst,
+                 const int width, const int height, int extrablur, float *restrict scratch)
+{
+    regular_1d_blur(src, tmp, width, height, scratch);
+    blur_rest(tmp, dst, width, height, extrablur, scratch);
+}
+
+/*
+ * First pass of blur() for img1*img2, img2 and img2*img2 at once, so both
+ * images are read only once. The products are made BLUR_TILE rows at a time
+ * and blurred while they're still in cache. Only this pass is shared: the
+ * rest of blur() runs per plane in blur_rest(), which already keeps one band
+ * in cache. Against the products plus three blur()s it measured -2% to +3%
+ * on 128-row bands 550-4000 wide (-Os, AVX2), which is within the noise.
+ */
+static void first_blur_products(const float *restrict img1, const float *restrict img2,
+                                float *restrict dst12, float *restrict dst2, float *restrict dst22,
+                                const int width, const int height, float *restrict scratch)
+{
+    float *restrict p12 = scratch;
+    float *restrict p22 = scratch + width * BLUR_TILE;
+    scratch += 2 * width * BLUR_TILE;
+
+    for (int j = 0; j < height; j += BLUR_TILE) {
+        const int offset = j * width;
+        const int rows = MIN(BLUR_TILE, height - j);
+
+        for (int i = 0; i < rows * width; i++) {
+            p12[i] = img1[offset + i] * img2[offset + i];
+            p22[i] = img2[offset + i] * img2[offset + i];
+        }
+        regular_1d_blur(p12, dst12 + offset, width, rows, scratch);
+        regular_1d_blur((float *)img2 + offset, dst2 + offset, width, rows, scratch);
+        regular_1d_blur(p22, dst22 + offset, width, rows, scratch);
+    }
+}
+
+/*
+ * How many rows above and below an output row of blur() it depends on.
+ * Vertically the regular blur reaches 1 row down, the transposing one 3 up
+ * and 4 down, so a band of rows blurred on its own comes out the same as
+ * the whole frame except for this many rows at its ends.
+ */
+static int blur_halo(const int extrablur)
+{
+    return extrablur ? 14 : 6;
+}
+
+/*
+ * Returns at least n floats of the arena, growing it if needed; NULL if that fails
+ */
+static float *arena_floats(dssim_arena *arena, const size_t n)
+{
+    if (n > arena->size) {
+        free(arena->mem);
+        arena->mem = malloc(n * sizeof(float));
+        arena->size = arena->mem ? n : 0;
+    }
+    return arena->mem;
+}
+
+/*
+ * Runs fn on each of count jobs (size bytes apart) on the calling thread and
+ * inf's helper threads. Each thread works in its own arena of inf's.
+ * Jobs write their results only to their own struct or rows, so the outcome
+ * doesn't depend on which thread ran what.
+ */
+typedef void jobfunc(void *job, dssim_arena *arena);
+
+typedef struct {
+    jobfunc *fn;
+    char *jobs;
+    size_t size;
+    int count, next;
+    dssim_arena *arenas;
+    pthread_mutex_t lock;
+} job_queue;
+
+/*
+ Helper threads started by dssim_set_threads() and kept until dssim_dealloc(),
+ so that every blur and comparison doesn't start threads of its own. They
+ sleep until run_jobs() hands them a queue.
+ */
+typedef struct {
+    job_pool *pool;
+    int index; // arena index, 0 being the calling thread's
+} job_helper;
+
+struct job_pool {
+    pthread_t *threads;
+    job_helper *helpers;
+    int count; // helpers running
+    pthread_mutex_t lock;
+    pthread_cond_t wake, idle;
+    job_queue *queue;
+    unsigned generation; // bumped for each queue
+    int busy;            // helpers not done with the queue yet
+    int quit;
+};
+
+static void run_queue(job_queue *q, dssim_arena *arena)
+{
+    for (;;) {
+        pthread_mutex_lock(&q->lock);
+        const int i = q->next++;
+        pthread_mutex_unlock(&q->lock);
+
+        if (i >= q->count) {
+            return;
+        }
+        q->fn(q->jobs + i * q->size, arena);
+    }
+}
+
+static void *pool_thread(void *arg)
+{
+    const job_helper *h = arg;
+    job_pool *pool = h->pool;
+    unsigned seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->quit && pool->generation == seen) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        if (pool->quit) {
+            break;
+        }
+        seen = pool->generation;
+        job_queue *q = pool->queue;
+        pthread_mutex_unlock(&pool->lock);
+
+        run_queue(q, &q->arenas[h->index]);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0) {
+            pthread_cond_signal(&pool->idle);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static void pool_stop(job_pool *pool)
+{
+    if (!pool) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->idle);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool->helpers);
+    free(pool);
+}
+
+/*
+ NULL if not a single helper could be started; the caller then runs jobs alone
+ */
+static job_pool *pool_start(const int helpers)
+{
+    job_pool *pool = calloc(1, sizeof(*pool));
+    if (!pool) {
+        return NULL;
+    }
+    pool->threads = calloc(helpers, sizeof(pool->threads[0]));
+    pool->helpers = calloc(helpers, sizeof(pool->helpers[0]));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+
+    while (pool->threads && pool->helpers && pool->count < helpers) {
+        job_helper *h = &pool->helpers[pool->count];
+        *h = (job_helper){.pool = pool, .index = pool->count + 1};
+        if (pthread_create(&pool->threads[pool->count], NULL, pool_thread, h)) {
+            break; // the others just take more jobs
+        }
+        pool->count++;
+    }
+    if (!pool->count) {
+        pool_stop(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+static void run_jobs(const dssim_info *inf, jobfunc *fn, void *jobs, const size_t size, const int count)
+{
+    job_queue q = {.fn = fn, .jobs = jobs, .size = size, .count = count, .arenas = inf->arenas};
+    job_pool *pool = inf->pool;
+
+    if (!pool || count < 2) {
+        for (int i = 0; i < count; i++) {
+            fn(q.jobs + i * size, &inf->arenas[0]);
+        }
+        return;
+    }
+
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_mutex_lock(&pool->lock);
+    pool->queue = &q;
+    pool->busy = pool->count;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    run_queue(&q, &inf->arenas[0]);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy) {
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    }
+    pool->queue = NULL;
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_destroy(&q.lock);
+}
+
+typedef struct {
+    float *src, *dst;
+    int width, height, extrablur;
+    int square; // blur src*src
+    int failed; // out of memory, dst is left as it was
+} blur_job;
+
+static void blur_job_run(void *arg, dssim_arena *arena)
+{
+    blur_job *job = arg;
+    const int size = job->width * job->height;
+    float *tmp = arena_floats(arena, 2 * (size_t)size + BLUR_SCRATCH(job->width, job->height));
+    if (!tmp) {
+        job->failed = 1;
+        return;
+    }
+    float *scratch = tmp + size;
+    float *src = job->src;
+
+    if (job->square) {
+        src = scratch;
+        scratch += size;
+        for (int j = 0; j < size; j++) {
+            src[j] = job->src[j] * job->src[j];
+        }
+    }
+
+    blur(src, tmp, job->dst, job->width, job->height, job->extrablur, scratch);
+}
+
+/*
+ Runs the blurs; returns 1 if any of them ran out of memory
+ */
+static int run_blur_jobs(dssim_info *inf, blur_job jobs[], const int count)
+{
+    int failed = 0;
+    run_jobs(inf, blur_job_run, jobs, sizeof(jobs[0]), count);
+    for (int i = 0; i < count; i++) {
+        failed |= jobs[i].failed;
+    }
+    return failed;
+}
+
+/*
+ Returns 1 if out of memory
+ */
+static int convert_image(const dssim_info *inf, float *restrict chans[], dssim_row_callback cb, void *callback_user_data)
+{
+    const int width = inf->chan[0].width;
+    const int height = inf->chan[0].height;
+    float *row_tmp[inf->channels];
+    int failed = 0;
+
+    for(int ch = 1; ch < inf->channels; ch++) {
+        row_tmp[ch] = calloc(width, sizeof(float)); // for the callback all channels have the same width!
+        failed |= !row_tmp[ch];
+    }
+    if (failed) {
+        for(int ch = 1; ch < inf->channels; ch++) {
+            free(row_tmp[ch]);
+        }
+        return 1;
+    }
+
+    for(int y = 0; y < height; y++) {
+        row_tmp[0] = &chans[0][width * y]; // Luma can be written directly (it's unscaled)
+
+        cb(inf, row_tmp, inf->channels, y, width, callback_user_data);
+
+        for(int ch = 1; ch < inf->channels; ch++) { // Chroma is downsampled
+            const int halfy = y * inf->chan[ch].height / height;
+            float *dstrow = &chans[ch][halfy * inf->chan[ch].width];
+
+            for(int x = 0; x < width; x++) {
+                dstrow[x/2] += row_tmp[ch][x] * 0.25f;
+            }
+        }
+    }
+
+    for(int ch = 1; ch < inf->channels; ch++) {
+        free(row_tmp[ch]);
+    }
+    return 0;
+}
+
+static void convert_image_row(const dssim_info *const inf, float *const channels[], const int num_channels, const int y, const int width, void *user_data)
+{
+    const dssim_rgba *const row = ((dssim_rgba **)user_data)[y];
+    const int chroma = num_channels >= 3;
+
+    convert_row(inf->gamma_lut, row, channels[0], chroma ? channels[1] : NULL, chroma ? channels[2] : NULL, width, y);
+}
+
+/*
+ All values are in 0..1 (see convert_pixel()), so img1 and mu1 are stored as 16-bit
+ fixed point. img1 is rounded to that before mu1 and sigma1_sq are blurred from it, so
+ that mu1 stays consistent with img1*img2 and doesn't skew the covariance. mu1's own
+ rounding (at most 7.6e-6) moves the covariance of flat areas by up to a percent of c2,
+ but without bias, and on examples/ it moved dssim by under 6e-4, about 1% of imgmin's
+ threshold. sigma1_sq isn't needed as such: only the variance sigma1_sq - mu1*mu1 is,
+ which is at most 1/4 and keeps well in 16 bits (sigma1_sq itself would lose it all in
+ the subtraction).
+ */
+#define VAR_SCALE 4.f
+
+static uint16_t pack_16(const float v)
+{
+    const float f = v * 65535.f + 0.5f;
+    return f <= 0.f ? 0 : f >= 65535.f ? 65535 : (uint16_t)f;
+}
+
+static float unpack_16(const uint16_t v)
+{
+    return v * (1.f / 65535.f);
+}
+
+static void round_to_16(float *img, const int n)
+{
+    for (int i = 0; i < n; i++) {
+        img[i] = unpack_16(pack_16(img[i]));
+    }
+}
+
+/*
+ Leaves the channel in floats if out of memory
+ */
+static void pack_channel(dssim_info_chan *chan)
+{
+    const int n = chan->width * chan->height;
+    chan->img1_16 = malloc(n * sizeof(uint16_t));
+    chan->mu1_16 = malloc(n * sizeof(uint16_t));
+    chan->var1_16 = malloc(n * sizeof(uint16_t));
+    if (!chan->img1_16 || !chan->mu1_16 || !chan->var1_16) {
+        free(chan->img1_16); chan->img1_16 = NULL;
+        free(chan->mu1_16); chan->mu1_16 = NULL;
+        free(chan->var1_16); chan->var1_16 = NULL;
+        return;
+    }
+
+    for (int i = 0; i < n; i++) {
+        chan->img1_16[i] = pack_16(chan->img1[i]);
+        chan->mu1_16[i] = pack_16(chan->mu1[i]);
+        chan->var1_16[i] = pack_16((chan->sigma1_sq[i] - chan->mu1[i] * chan->mu1[i]) * VAR_SCALE);
+    }
+
+    free(chan->img1); chan->img1 = NULL;
+    free(chan->mu1); chan->mu1 = NULL;
+    free(chan->sigma1_sq); chan->sigma1_sq = NULL;
+}
+
+typedef struct {
+    const dssim_info *finer;
+    int modified;
+} pyramid_source;
+
+/*
+ Row callback for the next level of the pyramid, from the finer level's converted
+ (not yet blurred) image. Each pixel is the finer 4x4 pixels around it weighted
+ by 1 3 3 1 across and down (a small Gaussian, clamped at the edges), which
+ keeps detail the halved image can't show from aliasing into it more than a
+ 2x2 average does.
+ */
+static void pyramid_row(const dssim_info *const inf, float *const channels[], const int num_channels, const int y, const int width, void *user_data)
+{
+    static const float weights[4] = {1.f/64, 3.f/64, 3.f/64, 1.f/64};
+    const pyramid_source *src = user_data;
+    const dssim_info_chan *chan = src->finer->chan;
+    const int finer_width = chan[0].width, finer_height = chan[0].height;
+    (void)inf; // the finer level's images are already converted
+
+    const float *img = src->modified ? chan[0].img2 : chan[0].img1;
+    const float *rows[4];
+    for (int i = 0; i < 4; i++) {
+        const int finer_y = 2*y - 1 + i;
+        rows[i] = img + (finer_y < 0 ? 0 : MIN(finer_y, finer_height - 1)) * finer_width;
+    }
+    for (int x = 0; x < width; x++) {
+        const int left = x > 0 ? 2*x - 1 : 0, right = MIN(2*x + 2, finer_width - 1);
+        float sum = 0;
+        for (int i = 0; i < 4; i++) {
+            sum += weights[i] * (rows[i][left] + 3.f * (rows[i][2*x] + rows[i][2*x + 1]) + rows[i][right]);
+        }
+        channels[0][x] = sum;
+    }
+
+    // the finer level's chroma is already at half size
+    for (int ch = 1; ch < num_channels; ch++) {
+        const float *img = src->modified ? chan[ch].img2 : chan[ch].img1;
+        memcpy(channels[ch], img + y * chan[ch].width, MIN(width, chan[ch].width) * sizeof(float));
+    }
+}
+
+/*
+ Can be called only once. Copies the image.
+ Returns 1 if out of memory; inf can then only be dssim_dealloc()ed.
+ */
+int dssim_set_original(dssim_info *inf, dssim_rgba *row_pointers[], const int width, const int height, double gamma)
+{
+    set_gamma(inf, gamma);
+    return dssim_set_original_float_callback(inf, width, height, convert_image_row, (void*)row_pointers);
+}
+
+int dssim_set_original_float_callback(dssim_info *inf, const int width, const int height, dssim_row_callback cb, void *callback_user_data)
 {
     float *restrict chans[inf->channels];
     for(int ch = 0; ch < inf->channels; ch++) {
         inf->chan[ch].width = ch > 0 ? width/2 : width;
         inf->chan[ch].height = ch > 0 ? height/2 : height;
         inf->chan[ch].img1 = chans[ch] = calloc(inf->chan[ch].width * inf->chan[ch].height, sizeof(float));
+        if (!chans[ch]) {
+            return 1;
+        }
     }
 
-    convert_image(inf, chans, cb, callback_user_data);
+    if (convert_image(inf, chans, cb, callback_user_data)) {
+        return 1;
+    }
+
+    // without memory for a coarser level there are just fewer of them
+    if (inf->levels > 0 && width/2 >= PYRAMID_MIN_SIZE && height/2 >= PYRAMID_MIN_SIZE) {
+        inf->coarser = dssim_init(inf->channels);
+    }
+    if (inf->coarser) {
+        if (set_arenas(inf->coarser, inf->threads)) {
+            inf->coarser->pool = inf->pool;
+        }
+        dssim_set_pyramid(inf->coarser, inf->levels - 1);
+        dssim_set_compact(inf->coarser, inf->compact);
+
+        const pyramid_source src = {inf, 0};
+        if (dssim_set_original_float_callback(inf->coarser, width/2, height/2, pyramid_row, (void*)&src)) {
+            inf->coarser->pool = NULL; // not its own
+            dssim_dealloc(inf->coarser);
+            inf->coarser = NULL;
+        }
+    }
 
-    float *restrict sigma1_tmp = malloc(width * height * sizeof(float));
-    float *tmp = malloc(width * height * sizeof(float));
+    // chroma is blurred before its statistics are
+    blur_job jobs[2 * MAX_CHANS];
+    for (int ch = 1; ch < inf->channels; ch++) {
+        jobs[ch - 1] = (blur_job){.src = chans[ch], .dst = chans[ch], .width = inf->chan[ch].width, .height = inf->chan[ch].height};
+    }
+    if (run_blur_jobs(inf, jobs, inf->channels - 1)) {
+        return 1;
+    }
 
     for (int ch = 0; ch < inf->channels; ch++) {
         const int width = inf->chan[ch].width;
         const int height = inf->chan[ch].height;
 
-        float *img1 = inf->chan[ch].img1;
-        if (ch > 0) {
-            blur(img1, tmp, img1, width, height, NULL, 0);
-        }
-
-        for (int j = 0; j < width*height; j++) {
-            sigma1_tmp[j] = img1[j] * img1[j];
+        if (inf->compact) {
+            round_to_16(chans[ch], width * height);
         }
 
         inf->chan[ch].mu1 = malloc(width * height * sizeof(float));
-        blur(img1, tmp, inf->chan[ch].mu1, width, height, NULL, ch > 0);
-
         inf->chan[ch].sigma1_sq = malloc(width * height * sizeof(float));
-        blur(sigma1_tmp, tmp, inf->chan[ch].sigma1_sq, width, height, NULL, ch > 0);
+        if (!inf->chan[ch].mu1 || !inf->chan[ch].sigma1_sq) {
+            return 1;
+        }
+
+        jobs[2*ch] = (blur_job){.src = chans[ch], .dst = inf->chan[ch].mu1, .width = width, .height = height, .extrablur = ch > 0};
+        jobs[2*ch + 1] = (blur_job){.src = chans[ch], .dst = inf->chan[ch].sigma1_sq, .width = width, .height = height, .extrablur = ch > 0, .square = 1};
+    }
+    if (run_blur_jobs(inf, jobs, 2 * inf->channels)) {
+        return 1;
     }
 
-    free(tmp);
-    free(sigma1_tmp);
+    if (inf->compact) {
+        for (int ch = 0; ch < inf->channels; ch++) {
+            pack_channel(&inf->chan[ch]);
+        }
+    }
+    return 0;
 }
 
 /*
-    Returns 1 if image has wrong size.
+    Returns 1 if image has wrong size, or if out of memory.
 
     Can be called multiple times.
 */
 int dssim_set_modified(dssim_info *inf, dssim_rgba *row_pointers[], const int image_width, const int image_height, double gamma)
 {
-    set_gamma(gamma);
+    set_gamma(inf, gamma);
     return dssim_set_modified_float_callback(inf, image_width, image_height, convert_image_row, (void*)row_pointers);
 }
 
@@ -384,103 +1729,617 @@ int dssim_set_modified_float_callback(dssim_info *inf, const int image_width, co
 
     float *restrict img2[inf->channels];
     for (int ch = 0; ch < inf->channels; ch++) {
-        img2[ch] = calloc(inf->chan[ch].width * inf->chan[ch].height, sizeof(float));
+        const int size = inf->chan[ch].width * inf->chan[ch].height;
+        if (!inf->chan[ch].img2) {
+            inf->chan[ch].img2 = calloc(size, sizeof(float));
+            if (!inf->chan[ch].img2) {
+                return 1;
+            }
+        } else if (ch > 0) {
+            memset(inf->chan[ch].img2, 0, size * sizeof(float)); // chroma is accumulated
+        }
+        img2[ch] = inf->chan[ch].img2;
     }
 
-    convert_image(inf, img2, cb, callback_user_data);
+    if (convert_image(inf, img2, cb, callback_user_data)) {
+        return 1;
+    }
 
-    float *tmp = malloc(width * height * sizeof(float));
+    if (inf->coarser) {
+        const pyramid_source src = {inf, 1};
+        if (dssim_set_modified_float_callback(inf->coarser, width/2, height/2, pyramid_row, (void*)&src)) {
+            return 1;
+        }
+    }
+
+    blur_job jobs[MAX_CHANS];
+    for (int ch = 1; ch < inf->channels; ch++) {
+        jobs[ch - 1] = (blur_job){.src = img2[ch], .dst = img2[ch], .width = inf->chan[ch].width, .height = inf->chan[ch].height};
+    }
+    if (run_blur_jobs(inf, jobs, inf->channels - 1)) {
+        return 1;
+    }
+
+    // statistics of the modified image are computed band by band in dssim_compare_band()
+    inf->next_row = 0;
     for (int ch = 0; ch < inf->channels; ch++) {
-        const int width = inf->chan[ch].width;
-        const int height = inf->chan[ch].height;
+        inf->ssim_sum[ch] = 0;
+    }
+    inf->ssimmap = NULL;
+
+    return 0;
+}
+
+/*
+ Sums SSIM of rows y0..y1-1 of the channel. Statistics of the modified image are
+ blurred only for those rows, plus blur_halo() rows around them.
+ NaN if out of memory.
+ */
+static double compare_channel_rows(const dssim_info_chan *chan, const int y0, const int y1, const int extrablur, float *ssimmap, dssim_arena *arena)
+{
+    const int width = chan->width;
+    const int halo = blur_halo(extrablur);
+    const int band_y0 = y0 > halo ? y0 - halo : 0;
+    const int band_y1 = MIN(chan->height, y1 + halo);
+    const int band_height = band_y1 - band_y0;
+    const int size = width * band_height;
+
+    const int compact = chan->img1_16 != NULL;
+    const float *restrict img2 = chan->img2 + band_y0 * width;
+    float *buf[4];
+    buf[0] = arena_floats(arena, 4 * (size_t)size + 2 * width * BLUR_TILE + BLUR_SCRATCH(width, band_height)
+                                 + (compact ? size + 2 * width : 0));
+    if (!buf[0]) {
+        return NAN;
+    }
+    for (int i = 1; i < 4; i++) {
+        buf[i] = buf[i-1] + size;
+    }
+    float *restrict scratch = buf[3] + size;
+
+    // the compact original is unpacked after the blur scratch
+    float *restrict img1_band = scratch + 2 * width * BLUR_TILE + BLUR_SCRATCH(width, band_height);
+    float *restrict sigma1_sq_row = img1_band + size;
+    float *restrict mu1_row = sigma1_sq_row + width;
+    if (compact) {
+        const uint16_t *restrict src = chan->img1_16 + band_y0 * width;
+        for (int i = 0; i < size; i++) {
+            img1_band[i] = unpack_16(src[i]);
+        }
+    }
+    const float *restrict img1 = compact ? img1_band : chan->img1 + band_y0 * width;
+
+    // each statistic's first pass is blurred on into the buffer the previous one has freed
+    first_blur_products(img1, img2, buf[0], buf[1], buf[2], width, band_height, scratch);
+    blur_rest(buf[0], buf[3], width, band_height, extrablur, scratch);
+    blur_rest(buf[1], buf[0], width, band_height, extrablur, scratch);
+    blur_rest(buf[2], buf[1], width, band_height, extrablur, scratch);
+
+    const float *restrict sigma12 = buf[3];
+    const float *restrict mu2 = buf[0];
+    const float *restrict sigma2_sq = buf[1];
 
-        if (ch > 0) {
-            blur(img2[ch], tmp, img2[ch], width, height, NULL, 0);
+
+    double ssim_sum = 0;
+
+    for (int y = y0; y < y1; y++) {
+        const int offset = y * width;
+        const int band_offset = (y - band_y0) * width;
+
+        if (compact) {
+            for (int x = 0; x < width; x++) {
+                mu1_row[x] = unpack_16(chan->mu1_16[offset + x]);
+                sigma1_sq_row[x] = unpack_16(chan->var1_16[offset + x]) * (1.f / VAR_SCALE) + mu1_row[x] * mu1_row[x];
+            }
         }
-        float *restrict img1_img2 = malloc(width * height * sizeof(float));
-        float *restrict img1 = inf->chan[ch].img1;
+        const float *restrict mu1 = compact ? mu1_row : chan->mu1 + offset;
+        const float *restrict sigma1_sq = compact ? sigma1_sq_row : chan->sigma1_sq + offset;
 
-        for (int j = 0; j < width*height; j++) {
-            img1_img2[j] = img1[j] * img2[ch][j];
+        if (ssimmap) {
+            ssim_sum = ssim_row(ssim_sum, mu1, sigma1_sq,
+                                mu2 + band_offset, sigma2_sq + band_offset, sigma12 + band_offset,
+                                width, ssimmap + offset);
+        } else {
+            ssim_sum = ssim_row_sum(ssim_sum, mu1, sigma1_sq,
+                                    mu2 + band_offset, sigma2_sq + band_offset, sigma12 + band_offset, width);
         }
+    }
 
-        inf->chan[ch].sigma12 = malloc(width * height * sizeof(float));
-        blur(img1_img2, tmp, inf->chan[ch].sigma12, width, height, NULL, ch > 0);
+    return ssim_sum;
+}
 
-        inf->chan[ch].mu2 = img1_img2; // reuse mem
-        blur(img2[ch], tmp, inf->chan[ch].mu2, width, height, NULL, ch > 0);
+typedef struct {
+    const dssim_info_chan *chan;
+    int y0, y1, extrablur;
+    float *ssimmap;
+    double ssim_sum;
+} band_job;
 
-        inf->chan[ch].sigma2_sq = malloc(width * height * sizeof(float));
-        blur(img2[ch], tmp, inf->chan[ch].sigma2_sq, width, height, square_row, ch > 0);
-        free(img2[ch]);
+static void band_job_run(void *arg, dssim_arena *arena)
+{
+    band_job *job = arg;
+    job->ssim_sum = compare_channel_rows(job->chan, job->y0, job->y1, job->extrablur, job->ssimmap, arena);
+}
+
+/*
+ Compares the next `bands` bands of `rows` rows of the modified image (in
+ parallel, one job per band and channel) and returns the range the final dssim
+ can still be in. Every pixel's SSIM is in -1..1, so the rows not compared yet
+ can move the average only so far.
+
+ Band sums are added up in band order, so the result is the same for any
+ number of threads. Returns -1, with the range NaN, if out of memory.
+ */
+static int compare_rows(dssim_info *inf, const int rows, const int bands, double *dssim_min, double *dssim_max)
+{
+    const int height = inf->chan[0].height;
+    band_job jobs[bands * inf->channels];
+    int n = 0;
+    int y1 = inf->next_row;
+
+    for (int b = 0; b < bands && y1 < height; b++) {
+        const int y0 = y1;
+        y1 = MIN(height, y0 + rows);
+
+        for (int ch = 0; ch < inf->channels; ch++) {
+            const dssim_info_chan *chan = &inf->chan[ch];
+            // chroma rows of the band, so that bands tile the channel exactly
+            jobs[n++] = (band_job){
+                .chan = chan,
+                .y0 = y0 * chan->height / height,
+                .y1 = y1 * chan->height / height,
+                .extrablur = ch > 0,
+                .ssimmap = ch == 0 ? inf->ssimmap : NULL,
+            };
+        }
     }
-    free(tmp);
 
-    return 0;
+    run_jobs(inf, band_job_run, jobs, sizeof(jobs[0]), n);
+
+    for (int i = 0; i < n; i++) {
+        inf->ssim_sum[i % inf->channels] += jobs[i].ssim_sum;
+    }
+    inf->next_row = y1;
+
+    // a band that ran out of memory leaves its sum NaN
+    for (int ch = 0; ch < inf->channels; ch++) {
+        if (isnan(inf->ssim_sum[ch])) {
+            *dssim_min = *dssim_max = NAN;
+            return -1;
+        }
+    }
+
+    double ssim_min = 0, ssim_max = 0;
+    for (int ch = 0; ch < inf->channels; ch++) {
+        const dssim_info_chan *chan = &inf->chan[ch];
+        const double total = (double)chan->width * chan->height;
+        const double remaining = total - (double)chan->width * (y1 * chan->height / height);
+
+        ssim_min += (inf->ssim_sum[ch] - remaining) / total;
+        ssim_max += (inf->ssim_sum[ch] + remaining) / total;
+    }
+    ssim_min /= (double)inf->channels;
+    ssim_max /= (double)inf->channels;
+
+    *dssim_min = 1.0 / ssim_max - 1.0;
+    *dssim_max = ssim_min > 0 ? 1.0 / ssim_min - 1.0 : HUGE_VAL;
+
+    return y1 < height;
+}
+
+/*
+ Rows per band. Bands don't depend on the number of threads, so neither do
+ the results.
+ */
+static int band_rows(const dssim_info *inf)
+{
+    const int rows = (inf->chan[0].height + BANDS_MAX - 1) / BANDS_MAX;
+    return rows > BAND_ROWS_MIN ? rows : BAND_ROWS_MIN;
+}
+
+/*
+ Compares the next band of rows of the modified image (the next band per
+ thread with dssim_set_threads()), for callers that can stop as soon as they
+ know enough about the result.
+
+ Narrows dssim_min..dssim_max to the range dssim_compare() could still return.
+ Returns 1 while bands remain; once it returns 0 the whole image has been
+ compared and dssim_min == dssim_max is the dssim. Returns -1 if out of
+ memory, and the comparison can't go on.
+
+ You must call dssim_set_original and dssim_set_modified first.
+ */
+int dssim_compare_band(dssim_info *inf, double *dssim_min, double *dssim_max)
+{
+    return compare_rows(inf, band_rows(inf), inf->threads, dssim_min, dssim_max);
 }
 
-static double dssim_compare_channel(dssim_info_chan *chan, float **ssimmap);
+/*
+ The dssim of the rows dssim_compare_band() has compared so far, as if the
+ rest of the image were like them, and in *compared the fraction of the rows
+ that is. Unlike dssim_min..dssim_max this is no bound, but it's much closer:
+ the rows left can hold anything, which is all those allow for. Once
+ dssim_compare_band() returns 0 it is the dssim.
+ */
+double dssim_band_estimate(const dssim_info *inf, double *compared)
+{
+    const int height = inf->chan[0].height;
+    double ssim = 0;
+
+    *compared = (double)inf->next_row / height;
+
+    for (int ch = 0; ch < inf->channels; ch++) {
+        const dssim_info_chan *chan = &inf->chan[ch];
+        const double pixels = (double)chan->width * (inf->next_row * chan->height / height);
+
+        if (pixels <= 0) {
+            return 0;
+        }
+        ssim += inf->ssim_sum[ch] / pixels;
+    }
+    ssim /= (double)inf->channels;
+
+    return ssim > 0 ? 1.0 / ssim - 1.0 : HUGE_VAL;
+}
 
 /*
  Algorithm based on Rabah Mehdi's C++ implementation
 
- Returns dssim.
+ Returns dssim, NaN if out of memory.
  Saves dissimilarity visualisation as ssimfilename (pass NULL if not needed)
 
  You must call dssim_set_original and dssim_set_modified first.
  */
 double dssim_compare(dssim_info *inf, float **ssim_map_out)
 {
-    double avgssim = 0;
+    const int width = inf->chan[0].width;
+    const int height = inf->chan[0].height;
+    double dssim, dssim_max;
+
+    // all bands at once, the same as dssim_compare_band() goes through them
+    inf->next_row = 0;
     for (int ch = 0; ch < inf->channels; ch++) {
-        avgssim += dssim_compare_channel(&inf->chan[ch], ssim_map_out && ch == 0 ? ssim_map_out : NULL);
+        inf->ssim_sum[ch] = 0;
+    }
+    inf->ssimmap = ssim_map_out ? malloc(width * height * sizeof(float)) : NULL;
+
+    compare_rows(inf, band_rows(inf), BANDS_MAX, &dssim, &dssim_max);
+
+    if (ssim_map_out) {
+        *ssim_map_out = inf->ssimmap;
     }
-    avgssim /= (double)inf->channels;
+    inf->ssimmap = NULL;
+
+    return dssim;
+}
 
-    return 1.0 / (avgssim) - 1.0;
+/*
+ Number of halved levels dssim_set_original*() has made (at most as many as
+ dssim_set_pyramid() asked for, fewer for small images)
+ */
+int dssim_pyramid_levels(const dssim_info *inf)
+{
+    int levels = 0;
+    for (; inf->coarser; inf = inf->coarser) {
+        levels++;
+    }
+    return levels;
 }
 
-static double dssim_compare_channel(dssim_info_chan *chan, float **ssim_map_out)
+/*
+ dssim_compare() of the images halved `level` times. Being blurred by the
+ downsampling, they usually come out more similar than at full size, but not
+ always (up to 1.04x the full-size dssim on flat synthetic images), so it's
+ only an estimate that costs 1/4^level of the full comparison. NaN if out of
+ memory.
+ */
+double dssim_compare_level(dssim_info *inf, int level)
 {
-    const int width = chan->width;
-    const int height = chan->height;
+    for (; level > 0 && inf->coarser; level--) {
+        inf = inf->coarser;
+    }
+    return dssim_compare(inf, NULL);
+}
 
-    float *restrict mu1 = chan->mu1;
-    float *restrict mu2 = chan->mu2;
-    float *restrict sigma1_sq = chan->sigma1_sq;
-    float *restrict sigma2_sq = chan->sigma2_sq;
-    float *restrict sigma12 = chan->sigma12;
+/*
+ Streaming comparison.
 
-    const double c1 = 0.01 * 0.01, c2 = 0.03 * 0.03;
-    double avgssim = 0;
+ blur() is a cascade of box blurs along rows and along columns, so it can as
+ well be done a row at a time: the horizontal passes on each row as it comes,
+ and each vertical pass over a window of the last few rows it has been given.
+ Every stage outputs one row per row it's given once its window is full, so all
+ statistics of a row come out together and nothing larger than a window is kept.
+ */
 
-    float *const ssimmap = ssim_map_out ? chan->mu2 : NULL;
+/*
+ One vertical box blur: output row y is the average of input rows
+ y-up..y+down (clamped to the image)
+ */
+typedef struct {
+    int up, down;
+    int width, height;
+    int pushed; // input rows given so far, including ones past the end of the image
+    int slots;  // rows written to the window, including `up` copies of the first row
+    float *window, *out;
+} stream_vblur;
 
-    for (int offset = 0; offset < width * height; offset++) {
-        const double mu1_sq = mu1[offset]*mu1[offset];
-        const double mu2_sq = mu2[offset]*mu2[offset];
-        const double mu1mu2 = mu1[offset]*mu2[offset];
+/*
+ Row by row version of blur(): horizontal blurs of `size` 1 or 4, then vertical ones
+ */
+typedef struct {
+    int width;
+    int hsizes[4], nh;
+    stream_vblur v[8];
+    int nv;
+    float *row, *tmp;
+} stream_blur;
+
+static void stream_vblur_init(stream_vblur *v, const int size, const int width, const int height)
+{
+    // same reach as the scalar sliding sums
+    *v = (stream_vblur){
+        .up = size - 1,
+        .down = size,
+        .width = width,
+        .height = height,
+        .window = malloc(2 * size * width * sizeof(float)),
+        .out = malloc(width * sizeof(float)),
+    };
+}
 
-        const double ssim = (c1 + 2.0 * mu1mu2) * (c2 + 2.0 * (sigma12[offset] - mu1mu2))
-                            /
-                            ((c1 + mu1_sq + mu2_sq) * (c2 + sigma1_sq[offset] - mu1_sq + sigma2_sq[offset] - mu2_sq));
+/*
+ Returns the next output row, or NULL while the window is still filling.
+ Rows past the end of the image are taken to be the last row of the image,
+ whatever is given.
+ */
+static const float *stream_vblur_push(stream_vblur *v, const float *row)
+{
+    const int n = v->up + v->down + 1;
+    const int width = v->width;
 
-        avgssim += ssim;
+    if (v->pushed++ >= v->height) {
+        row = v->window + ((v->slots - 1) % n) * width;
+    }
+    if (!v->slots) {
+        for (; v->slots < v->up; v->slots++) {
+            memcpy(v->window + v->slots * width, row, width * sizeof(float));
+        }
+    }
+    memcpy(v->window + (v->slots % n) * width, row, width * sizeof(float));
+    if (++v->slots < n) {
+        return NULL;
+    }
 
-        if (ssimmap) {
-            ssimmap[offset] = ssim;
+    float *restrict out = v->out;
+    memcpy(out, v->window + (v->slots % n) * width, width * sizeof(float));
+    for (int k = v->slots - n + 1; k < v->slots; k++) {
+        const float *restrict in = v->window + (k % n) * width;
+        for (int x = 0; x < width; x++) {
+            out[x] += in[x];
         }
     }
+    for (int x = 0; x < width; x++) {
+        out[x] /= (float)n;
+    }
+    return out;
+}
 
-    if (ssim_map_out) {
-        *ssim_map_out = ssimmap; // reuses mu2 memory
-    } else {
-        free(chan->mu2);
+static void stream_blur_init(stream_blur *b, const int width, const int height, const int extrablur)
+{
+    static const int luma_h[] = {1, 1, 4}, luma_v[] = {1, 1, 4};
+    static const int chroma_h[] = {1, 1, 4, 4}, chroma_v[] = {4, 1, 1, 1, 1, 1, 1, 4};
+    const int *hsizes = extrablur ? chroma_h : luma_h;
+    const int *vsizes = extrablur ? chroma_v : luma_v;
+
+    b->width = width;
+    b->nh = extrablur ? 4 : 3;
+    b->nv = extrablur ? 8 : 3;
+    for (int i = 0; i < b->nh; i++) {
+        b->hsizes[i] = hsizes[i];
     }
-    chan->mu2 = NULL;
+    for (int i = 0; i < b->nv; i++) {
+        stream_vblur_init(&b->v[i], vsizes[i], width, height);
+    }
+    b->row = malloc(width * sizeof(float));
+    b->tmp = malloc(width * sizeof(float));
+}
 
-    free(chan->sigma12); chan->sigma12 = NULL;
-    free(chan->sigma2_sq); chan->sigma2_sq = NULL;
+static int stream_blur_ok(const stream_blur *b)
+{
+    int ok = b->row && b->tmp;
+    for (int i = 0; i < b->nv; i++) {
+        ok &= b->v[i].window && b->v[i].out;
+    }
+    return ok;
+}
+
+static void stream_blur_free(stream_blur *b)
+{
+    for (int i = 0; i < b->nv; i++) {
+        free(b->v[i].window);
+        free(b->v[i].out);
+    }
+    free(b->row);
+    free(b->tmp);
+}
+
+/*
+ Returns the next blurred row, or NULL until enough rows have been given
+ */
+static const float *stream_blur_push(stream_blur *b, const float *row)
+{
+    memcpy(b->row, row, b->width * sizeof(float));
+    for (int i = 0; i < b->nh; i++) {
+        if (b->hsizes[i] == 1) {
+            regular_1d_blur_scalar(b->row, b->tmp, b->width, 1, NULL);
+        } else {
+            transposing_1d_blur_rows(b->row, b->tmp, b->width, 1, 0, 1);
+        }
+        float *t = b->row; b->row = b->tmp; b->tmp = t;
+    }
+
+    const float *out = b->row;
+    for (int i = 0; out && i < b->nv; i++) {
+        out = stream_vblur_push(&b->v[i], out);
+    }
+    return out;
+}
+
+typedef struct {
+    int width, height;
+    int extrablur;
+    stream_blur img1, img2; // chroma is blurred before its statistics are
+    stream_blur mu1, sigma1_sq, mu2, sigma2_sq, sigma12;
+    float *img1_sq, *img2_sq, *img1_img2;
+    int rows_done;
+    double ssim_sum;
+} stream_chan;
+
+static void stream_chan_init(stream_chan *c, const int width, const int height, const int extrablur)
+{
+    *c = (stream_chan){.width = width, .height = height, .extrablur = extrablur};
+    if (extrablur) {
+        stream_blur_init(&c->img1, width, height, 0);
+        stream_blur_init(&c->img2, width, height, 0);
+    }
+    stream_blur_init(&c->mu1, width, height, extrablur);
+    stream_blur_init(&c->sigma1_sq, width, height, extrablur);
+    stream_blur_init(&c->mu2, width, height, extrablur);
+    stream_blur_init(&c->sigma2_sq, width, height, extrablur);
+    stream_blur_init(&c->sigma12, width, height, extrablur);
+    c->img1_sq = malloc(width * sizeof(float));
+    c->img2_sq = malloc(width * sizeof(float));
+    c->img1_img2 = malloc(width * sizeof(float));
+}
+
+/*
+ 0 if stream_chan_init() ran out of memory
+ */
+static int stream_chan_ok(const stream_chan *c)
+{
+    return (!c->extrablur || (stream_blur_ok(&c->img1) && stream_blur_ok(&c->img2))) &&
+           stream_blur_ok(&c->mu1) && stream_blur_ok(&c->sigma1_sq) &&
+           stream_blur_ok(&c->mu2) && stream_blur_ok(&c->sigma2_sq) && stream_blur_ok(&c->sigma12) &&
+           c->img1_sq && c->img2_sq && c->img1_img2;
+}
+
+static void stream_chan_free(stream_chan *c)
+{
+    if (c->extrablur) {
+        stream_blur_free(&c->img1);
+        stream_blur_free(&c->img2);
+    }
+    stream_blur_free(&c->mu1);
+    stream_blur_free(&c->sigma1_sq);
+    stream_blur_free(&c->mu2);
+    stream_blur_free(&c->sigma2_sq);
+    stream_blur_free(&c->sigma12);
+    free(c->img1_sq);
+    free(c->img2_sq);
+    free(c->img1_img2);
+}
+
+/*
+ Takes the next row of both images and adds up SSIM of rows as they come out.
+ After the last row of the image, keep pushing anything until rows_done == height.
+ */
+static void stream_chan_push(stream_chan *c, const float *row1, const float *row2)
+{
+    if (c->extrablur) {
+        row1 = stream_blur_push(&c->img1, row1);
+        row2 = stream_blur_push(&c->img2, row2);
+        if (!row1) {
+            return;
+        }
+    }
+
+    for (int x = 0; x < c->width; x++) {
+        c->img1_sq[x] = row1[x] * row1[x];
+        c->img2_sq[x] = row2[x] * row2[x];
+        c->img1_img2[x] = row1[x] * row2[x];
+    }
+
+    const float *mu1 = stream_blur_push(&c->mu1, row1);
+    const float *sigma1_sq = stream_blur_push(&c->sigma1_sq, c->img1_sq);
+    const float *mu2 = stream_blur_push(&c->mu2, row2);
+    const float *sigma2_sq = stream_blur_push(&c->sigma2_sq, c->img2_sq);
+    const float *sigma12 = stream_blur_push(&c->sigma12, c->img1_img2);
+
+    if (mu1 && c->rows_done++ < c->height) {
+        c->ssim_sum = ssim_row_sum(c->ssim_sum, mu1, sigma1_sq, mu2, sigma2_sq, sigma12, c->width);
+    }
+}
+
+/*
+ Compares two images given row by row by the callbacks, which are called once
+ for each row, in order, alternately for the original and the modified image.
+
+ Only a window of rows as tall as the blur is kept, so memory use depends on
+ the width only. Neither image is stored, and the original set with
+ dssim_set_original*() (if any) isn't used. The result differs from
+ dssim_compare() only by float rounding. No SSIM map.
+
+ Returns dssim, NaN if out of memory (the callbacks aren't called then).
+ */
+double dssim_compare_stream(dssim_info *inf, const int width, const int height,
+                            dssim_row_callback original_cb, void *original_data,
+                            dssim_row_callback modified_cb, void *modified_data)
+{
+    const int channels = inf->channels;
+    stream_chan chan[MAX_CHANS];
+    float *rows1[MAX_CHANS], *rows2[MAX_CHANS];
+    float *acc1[MAX_CHANS], *acc2[MAX_CHANS];
+    int ok = 1;
+
+    for (int ch = 0; ch < channels; ch++) {
+        const int chan_width = ch > 0 ? width/2 : width;
+        const int chan_height = ch > 0 ? height/2 : height;
+        stream_chan_init(&chan[ch], chan_width, chan_height, ch > 0);
+        rows1[ch] = calloc(width, sizeof(float));
+        rows2[ch] = calloc(width, sizeof(float));
+        acc1[ch] = calloc(chan_width, sizeof(float));
+        acc2[ch] = calloc(chan_width, sizeof(float));
+        ok &= stream_chan_ok(&chan[ch]) && rows1[ch] && rows2[ch] && acc1[ch] && acc2[ch];
+    }
+
+    for (int y = 0; ok && y < height; y++) {
+        original_cb(inf, rows1, channels, y, width, original_data);
+        modified_cb(inf, rows2, channels, y, width, modified_data);
+
+        stream_chan_push(&chan[0], rows1[0], rows2[0]);
+
+        for (int ch = 1; ch < channels; ch++) { // Chroma is downsampled as in convert_image()
+            stream_chan *c = &chan[ch];
+            const int halfy = y * c->height / height;
+
+            for (int x = 0; x < width && x/2 < c->width; x++) {
+                acc1[ch][x/2] += rows1[ch][x] * 0.25f;
+                acc2[ch][x/2] += rows2[ch][x] * 0.25f;
+            }
+            if (y == height-1 || (y+1) * c->height / height != halfy) {
+                stream_chan_push(c, acc1[ch], acc2[ch]);
+                memset(acc1[ch], 0, c->width * sizeof(float));
+                memset(acc2[ch], 0, c->width * sizeof(float));
+            }
+        }
+    }
+
+    // flush the rows still in the blurs' windows
+    double ssim = 0;
+    for (int ch = 0; ch < channels; ch++) {
+        stream_chan *c = &chan[ch];
+        while (ok && c->rows_done < c->height) {
+            stream_chan_push(c, acc1[ch], acc2[ch]);
+        }
+        ssim += c->ssim_sum / ((double)c->width * c->height);
+
+        stream_chan_free(c);
+        free(rows1[ch]);
+        free(rows2[ch]);
+        free(acc1[ch]);
+        free(acc2[ch]);
+    }
+    ssim /= (double)channels;
 
-    return avgssim / ((double)width * height);
+    return ok ? 1.0 / ssim - 1.0 : NAN;
 }
@@ -9,6 +9,55 @@ dssim_info *dssim_init(int channels);
 
 void dssim_dealloc(dssim_info *inf);
 
+dssim_info *dssim_clone(const dssim_info *inf);
+
+/*
+  Splits blurs and comparisons across this many threads (default 1), started
+  here and kept until dssim_dealloc(). Results don't depend on the number.
+ */
+void dssim_set_threads(dssim_info *inf, int threads);
+
+/*
+  Which blur, SSIM and Lab conversion kernels all dssim_infos use: the fastest
+  the CPU runs (DSSIM_KERNELS_BEST, the default) or, to test them against each
+  other, the plain C, SSE2 or AVX2 ones; scores agree to float rounding.
+  Returns 0, changing nothing, if the CPU can't run them. Not to be called
+  while a comparison is running.
+ */
+enum {
+    DSSIM_KERNELS_BEST, DSSIM_KERNELS_SCALAR, DSSIM_KERNELS_SSE2, DSSIM_KERNELS_AVX2
+};
+int dssim_set_kernels(int kernels);
+
+/*
+  Call before dssim_set_original*() to also compare at up to `levels`
+  halvings of the size with dssim_compare_level() (level 0 is full size).
+  Each level is a Gaussian-filtered (4x4 binomial) halving of the one above.
+ */
+void dssim_set_pyramid(dssim_info *inf, int levels);
+
+/*
+  Call before dssim_set_original*() to keep the original's image, mean and
+  variance in 16-bit fixed point, so a dssim_info keeps 3/8 less memory (the
+  modified image stays in floats). Comparisons get about 7% slower, and
+  scores move by up to 6e-4.
+ */
+void dssim_set_compact(dssim_info *inf, int compact);
+
+/*
+  Number of halved levels dssim_set_original*() made: at most what
+  dssim_set_pyramid() asked for, fewer for small images or out of memory.
+ */
+int dssim_pyramid_levels(const dssim_info *inf);
+
+/*
+  dssim_compare() at `level` halvings of the size (clamped to
+  dssim_pyramid_levels()), for 1/4^level of the cost. An estimate, not a
+  bound: it's usually lower than at full size, but has measured up to 1.04x
+  of it. NaN if out of memory.
+ */
+double dssim_compare_level(dssim_info *inf, int level);
+
 /*
   Write one row (from index `y`) of `width` pixels to pre-allocated arrays in `channels`.
   if num_channels == 1 write only to channels[0][0..width-1]
@@ -16,10 +65,38 @@ void dssim_dealloc(dssim_info *inf);
  */
 typedef void dssim_row_callback(const dssim_info *const inf, float *const channels[], const int num_channels, const int y, const int width, void *user_data);
 
-void dssim_set_original(dssim_info *inf, dssim_rgba *row_pointers[], const int width, const int height, double gamma);
-void dssim_set_original_float_callback(dssim_info *inf, const int width, const int height, dssim_row_callback cb, void *callback_user_data);
+/*
+  The setters return non-zero if out of memory (dssim_set_modified*() also if
+  the size differs from the original's), and the comparisons NaN (-1 from
+  dssim_compare_band()); inf can then only be dssim_dealloc()ed.
+ */
+int dssim_set_original(dssim_info *inf, dssim_rgba *row_pointers[], const int width, const int height, double gamma);
+int dssim_set_original_float_callback(dssim_info *inf, const int width, const int height, dssim_row_callback cb, void *callback_user_data);
 
 int dssim_set_modified(dssim_info *inf, dssim_rgba *row_pointers[], const int width, const int height, double gamma);
 int dssim_set_modified_float_callback(dssim_info *inf, const int width, const int height, dssim_row_callback cb, void *callback_user_data);
 
 double dssim_compare(dssim_info *inf, float **ssimmap);
+
+/*
+  Compares the next band of rows (one per thread) and narrows
+  dssim_min..dssim_max to what dssim_compare() could still return. Returns 1
+  while bands remain, 0 once done (then dssim_min == dssim_max is the dssim),
+  -1 if out of memory. Starts over after each dssim_set_modified*().
+ */
+int dssim_compare_band(dssim_info *inf, double *dssim_min, double *dssim_max);
+
+/*
+  The dssim of the rows dssim_compare_band() has compared so far, as if the
+  rest of the image were like them, and the fraction of rows that is. A guess,
+  not a bound, until it's done.
+ */
+double dssim_band_estimate(const dssim_info *inf, double *compared);
+
+/*
+  Compares two images without storing them, reading both a row at a time
+  (memory use depends only on the width). Doesn't need dssim_set_original.
+ */
+double dssim_compare_stream(dssim_info *inf, const int width, const int height,
+                            dssim_row_callback original_cb, void *original_data,
+                            dssim_row_callback modified_cb, void *modified_data);
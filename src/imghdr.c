@@ -0,0 +1,118 @@
+/* ex: set ts=4 et: */
+/*
+ * Header-only image probe
+ *
+ * Lets the command line tool decide to leave an input alone before
+ * ImageMagick decodes it: a JPEG's dimensions and quantization tables are
+ * all in the markers ahead of its first scan, and a PNG's dimensions are in
+ * its first chunk.
+ */
+
+#include <string.h>
+#include "imghdr.h"
+#include "jpegq.h"
+
+#define be16(p) ((unsigned)(p)[0] << 8 | (p)[1])
+#define be32(p) ((unsigned)(p)[0] << 24 | (unsigned)(p)[1] << 16 | (unsigned)(p)[2] << 8 | (p)[3])
+
+/* a DQT lists its table in zigzag order; this is where each entry goes */
+static const unsigned char natural_order[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10,
+    17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34,
+    27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36,
+    29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46,
+    53, 60, 61, 54, 47, 55, 62, 63
+};
+
+static int read_png(const unsigned char *blob, size_t size, struct imghdr *hdr)
+{
+    static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+
+    /* signature, then the IHDR chunk: length, type, width, height */
+    if (size < 24 || memcmp(blob, signature, sizeof signature) || memcmp(blob + 12, "IHDR", 4))
+        return 0;
+    hdr->format = "PNG";
+    hdr->width = be32(blob + 16);
+    hdr->height = be32(blob + 20);
+    hdr->quality = 0;
+    return 1;
+}
+
+static int read_jpeg(const unsigned char *blob, size_t size, struct imghdr *hdr)
+{
+    unsigned short qtbl[4][64];
+    int have_qtbl[4] = { 0, 0, 0, 0 };
+    int luma_tbl = -1;
+    size_t pos = 2;
+
+    if (size < 4 || blob[0] != 0xFF || blob[1] != 0xD8)
+        return 0;
+    hdr->format = "JPEG";
+    hdr->width = hdr->height = hdr->quality = 0;
+
+    while (pos + 4 <= size)
+    {
+        const unsigned marker = blob[pos + 1];
+        size_t len, end;
+
+        if (blob[pos] != 0xFF)
+            return 0;
+        if (marker == 0xFF)     /* fill byte */
+        {
+            pos++;
+            continue;
+        }
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7))
+        {
+            pos += 2;           /* no length */
+            continue;
+        }
+        if (marker == 0xDA || marker == 0xD9)
+            break;              /* start of scan: everything needed came before */
+
+        len = be16(blob + pos + 2);
+        end = pos + 2 + len;
+        if (len < 2 || end > size)
+            return 0;
+
+        if (marker == 0xDB)     /* DQT: one or more tables */
+        {
+            size_t p = pos + 4;
+            while (p < end)
+            {
+                const unsigned precision = blob[p] >> 4, id = blob[p] & 3;
+                int k;
+                if (p + 1 + 64 * (precision + 1) > end)
+                    return 0;
+                for (k = 0; k < 64; k++)
+                    qtbl[id][natural_order[k]] = precision ? be16(blob + p + 1 + 2 * k) : blob[p + 1 + k];
+                have_qtbl[id] = 1;
+                p += 1 + 64 * (precision + 1);
+            }
+        }
+        else if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC)
+        {
+            /* SOFn: precision, height, width, components, then the first (luma) component */
+            if (len < 11)
+                return 0;
+            hdr->height = be16(blob + pos + 5);
+            hdr->width = be16(blob + pos + 7);
+            luma_tbl = blob[pos + 12] & 3;
+        }
+        pos = end;
+    }
+
+    if (luma_tbl >= 0 && have_qtbl[luma_tbl])
+        hdr->quality = jpegq_ijg_quality(qtbl[luma_tbl]);
+    return hdr->width && hdr->height;
+}
+
+int imghdr_read(const unsigned char *blob, size_t size, struct imghdr *hdr)
+{
+    if (!blob)
+        return 0;
+    return read_jpeg(blob, size, hdr) || read_png(blob, size, hdr);
+}
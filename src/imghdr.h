@@ -0,0 +1,26 @@
+/* ex: set ts=4 et: */
+
+#ifndef IMGHDR_H
+#define IMGHDR_H
+
+#include <stddef.h>
+
+/*
+ * what an image's headers say about it, without decoding anything
+ */
+struct imghdr
+{
+    const char *format;     /* "JPEG" or "PNG" */
+    unsigned width,
+             height,
+             quality;       /* JPEG only: the IJG quality of the luma quantization table,
+                               0 if there is none or it isn't a scaled IJG table */
+};
+
+/*
+ * parse the JPEG markers up to the first scan, or the PNG IHDR chunk.
+ * returns 0 if blob is neither, or too damaged to tell
+ */
+int imghdr_read(const unsigned char *blob, size_t size, struct imghdr *hdr);
+
+#endif
@@ -20,16 +20,29 @@
 #include <sys/types.h>
 #if !defined(_WIN32) && !defined(__CYGWIN__)
 #include <sys/wait.h>
+#include <sys/mman.h>
 #endif
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <string.h>
 #include <math.h>
 #include <float.h> /* DBL_EPSILON */
+#include <stdint.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <wand/MagickWand.h>
 #include "imgmin.h"
 #include "dssim.h"
+#include "jpegq.h"
+#include "jpegenc.h"
+#include "imghdr.h"
+
+#define min(a,b) ((a) < (b) ? (a) : (b))
+#define max(a,b) ((a) > (b) ? (a) : (b))
 
 #ifndef IMGMIN_LIB /* not the Apache mopdule... (we assume cmdline) */
 #define IMGMIN_STANDALONE
@@ -91,6 +104,16 @@
  */
 #define QUALITY_IN_MIN            82
 
+/*
+ * JPEGs are first checked against QUALITY_IN_MIN from their headers alone,
+ * which skips decoding the ones that are left unchanged anyway. only luma
+ * tables that are exactly a scaled IJG table are trusted there (see
+ * jpegq_ijg_quality()); any other table is left to ImageMagick's estimate
+ * after decoding. ImageMagick estimates from table sums, so to allow for its
+ * rounding only inputs this far under are decided from the headers
+ */
+#define QUALITY_IN_MARGIN          2
+
 /*
  * never perform more than this many steps.
  * each step transforms the entire image and whose cost is based on the size
@@ -101,7 +124,130 @@
  */
 #define MAX_STEPS                  5
 
-#define ThrowWandException(wand)                                \
+/*
+ * number of candidate qualities evaluated in parallel per search step.
+ * 1 performs a plain binary search; N > 1 narrows the quality range by a
+ * factor of N+1 per step at the cost of N concurrent encodes and comparisons
+ * override via --threads N
+ */
+#define THREADS                    1
+#define THREADS_MAX                7
+
+/*
+ * threads each comparison's blurs and bands are split across, on top of
+ * --threads. they're started once per search worker and kept for the whole
+ * search; scores are the same for any number
+ * override via --dssim-threads N
+ */
+#define DSSIM_THREADS              1
+#define DSSIM_THREADS_MAX          8
+
+/*
+ * search JPEG qualities by requantizing the original's DCT coefficients
+ * rather than re-encoding pixels through ImageMagick. much cheaper per step;
+ * the output keeps the original's chroma sampling and the color density
+ * check is skipped.
+ * override via --requantize
+ */
+#define REQUANTIZE                 0
+
+/*
+ * encode JPEG candidates, and so the output, with libjpeg over one shared
+ * copy of the pixels (src/jpegenc.c) rather than with ImageMagick's writer,
+ * which sets the quality on the wand it encodes and so needs a copy of the
+ * image per --threads worker. the settings are those ImageMagick is given
+ * (stripped, 2x2 chroma subsampling, progressive if the input was, the same
+ * density), but the bytes are libjpeg's and aren't checked against
+ * ImageMagick's output, so it's opt-in.
+ * override via --jpegenc
+ */
+#define JPEGENC                    0
+
+/*
+ * decode JPEG candidates straight to luma with libjpeg, rather than to RGB
+ * through ImageMagick, and measure the original's luma with the encoder's
+ * weights. candidates skip chroma upsampling and color conversion, and
+ * the color density check is skipped. candidates are then encoded as with
+ * --jpegenc
+ * override via --luma-decode
+ */
+#define LUMA_DECODE                0
+
+/*
+ * run the search on a copy of the image downscaled by this factor (2, 4 or 8),
+ * then confirm the answer q at full resolution by probing q and q-1, which
+ * settles it in two steps when it holds; otherwise the range those probes
+ * leave is bisected. full-size steps stay within --max-steps either way. the
+ * proxy's error is anywhere from a third to nearly three times the full-size
+ * error at the same quality, so no fixed threshold adjustment fits; its answer
+ * is only where the full-size search starts. images whose proxy would be
+ * smaller than PROXY_MIN_SIZE on either side are searched at full resolution.
+ * see test/proxy_scale.c (make check) for the steps it takes on examples/
+ * override via --proxy-scale N
+ */
+#define PROXY_SCALE                1
+#define PROXY_MIN_SIZE           256
+
+/*
+ * compare each candidate at 1/2, 1/4 ... 1/2^N of the size, coarsest first,
+ * before comparing it at full size, and reject it without the full comparison
+ * if a smaller copy already measures over PYRAMID_MARGIN times the threshold.
+ * this is a heuristic, not a bound: downsampling usually hides JPEG artifacts,
+ * but on the examples/ luma of flat synthetic images (color_quads) the 1/2
+ * size measured up to 1.04 times the full-size error (1.55 at 1/4 before the
+ * levels were Gaussian-filtered). override via --pyramid N
+ */
+#define PYRAMID                    0
+#define PYRAMID_MAX                4
+#define PYRAMID_MARGIN           1.5
+
+/*
+ * decide a candidate from the part of the image compared so far, once that's
+ * at least EARLY_COMPARED of its rows and measures over EARLY_MARGIN times
+ * the threshold or under the threshold divided by it. like --pyramid this is
+ * a heuristic: the rest of the image could differ. without it a candidate is
+ * only cut short when the rows left can't change the verdict whatever they
+ * hold. on the examples/ luma at every quality from 60 to 92 (330 comparisons,
+ * 1188 bands) that stopped 8 comparisons early at threshold 1.0 and 89 at
+ * 0.5; the estimate decided 249 and 224 early, comparing 733 and 801 of the
+ * bands, and never differently from the full comparison. trusted from the
+ * first band it got 24 verdicts wrong at 0.5, and with margin 1.25 it got 6,
+ * nearly all accepting candidates that end up over the threshold
+ * override via --early-verdict
+ */
+#define EARLY_VERDICT              0
+#define EARLY_MARGIN             1.5
+#define EARLY_COMPARED           0.5
+
+/*
+ * keep the original's DSSIM image, mean and variance in 16 bits per value,
+ * for 3/8 less memory per search worker at about 7% more time comparing.
+ * scores move by up to 6e-4, about 1% of the threshold, so this pays off only
+ * when --threads workers of a large image wouldn't fit in memory otherwise
+ * override via --compact
+ */
+#define COMPACT                    0
+
+/*
+ * compare candidates of images this many megapixels or larger a row at a
+ * time, reading the original again for each, so that no worker keeps full
+ * frames of DSSIM statistics. only the luma-decode and requantize searches,
+ * whose originals can be read again cheaply, do so; candidates are then
+ * always compared in full, without --pyramid or an early verdict. 0 never
+ * override via --stream-mp N
+ */
+#define STREAM_MP                  0
+
+/*
+ * how the next quality to try is chosen
+ * SEARCH_BISECT: halve the quality range each step
+ * SEARCH_SECANT: interpolate where the measured error crosses the threshold,
+ *                falling back to bisection when that stalls
+ * override via --search bisect|secant
+ */
+#define SEARCH                     SEARCH_BISECT
+
+#define PrintWandException(wand)                                \
 {                                                               \
     char *description;                                          \
     ExceptionType severity;                                     \
@@ -109,246 +255,1281 @@
     (void) fprintf(stderr,"%s %s %lu %s\n",                     \
       GetMagickModule(),description);                           \
     description = (char *) MagickRelinquishMemory(description); \
+}
+
+#define ThrowWandException(wand)                                \
+{                                                               \
+    PrintWandException(wand);                                   \
     exit(-1);                                                   \
 }
 
+/* a bit per 24-bit color, see count_colors() */
+#define COLOR_BITS_WORDS    ((1 << 24) / 32)
+#define COLOR_ROWS          64
+
+/*
+ * number of distinct colors in mw.
+ * 8-bit images without alpha are counted in bits, a zeroed bitset of
+ * COLOR_BITS_WORDS words (2MB) that is zeroed again before returning so the
+ * caller can keep reusing it. anything else goes to MagickGetImageColors(),
+ * which builds a full color tree
+ */
+static size_t count_colors(MagickWand *mw, uint32_t *bits)
+{
+    const size_t width = MagickGetImageWidth(mw);
+    const size_t height = MagickGetImageHeight(mw);
+    unsigned char *buf = NULL;
+    size_t colors = 0;
+    size_t y, i;
+
+    if (bits && MagickGetImageDepth(mw) <= 8 && MagickGetImageAlphaChannel(mw) != MagickTrue)
+    {
+        buf = malloc(width * 3 * COLOR_ROWS);
+    }
+    if (!buf)
+    {
+        return MagickGetImageColors(mw);
+    }
+
+    for (y = 0; y < height; y += COLOR_ROWS)
+    {
+        const size_t rows = min(COLOR_ROWS, height - y);
+        if (MagickExportImagePixels(mw, 0, y, width, rows, "RGB", CharPixel, buf) != MagickTrue)
+        {
+            colors = MagickGetImageColors(mw);
+            break;
+        }
+        for (i = 0; i < width * rows; i++)
+        {
+            const uint32_t c = (uint32_t)buf[3*i] << 16 | buf[3*i+1] << 8 | buf[3*i+2];
+            const uint32_t bit = (uint32_t)1 << (c & 31);
+            colors += !(bits[c >> 5] & bit);
+            bits[c >> 5] |= bit;
+        }
+    }
+    free(buf);
+    memset(bits, 0, COLOR_BITS_WORDS * sizeof *bits);
+    return colors;
+}
+
 static size_t unique_colors(MagickWand *mw)
 {
-    return MagickGetImageColors(mw);
+    uint32_t *bits = calloc(COLOR_BITS_WORDS, sizeof *bits);
+    const size_t colors = count_colors(mw, bits);
+    free(bits);
+    return colors;
+}
+
+static unsigned long quality(MagickWand *mw)
+{
+    return GetImageFromMagickWand(mw)->quality;
+}
+
+static double color_density(MagickWand *mw, size_t colors)
+{
+    const size_t area = MagickGetImageHeight(mw) * MagickGetImageWidth(mw);
+    double density = (double)colors / area;
+    return density;
+}
+
+
+#ifndef IMGMIN_LIB
+static const char * type2str(const ImageType t)
+{
+    return
+           t == UndefinedType            ? "Undefined"            :
+           t == BilevelType              ? "Bilevel"              :
+           t == GrayscaleType            ? "Grayscale"            :
+           t == GrayscaleMatteType       ? "GrayscaleMatte"       :
+           t == PaletteType              ? "Palette"              :
+           t == PaletteMatteType         ? "PaletteMatte"         :
+           t == TrueColorType            ? "TrueColor"            :
+           t == TrueColorMatteType       ? "TrueColorMatte"       :
+           t == ColorSeparationType      ? "ColorSeparation"      :
+           t == ColorSeparationMatteType ? "ColorSeparationMatte" :
+           t == OptimizeType             ? "Optimize"             :
+#if MagickLibVersion >= 0x630 /* FIXME: available in 0x660, not available in 0x628, not sure which version it was introduced in */
+           t == PaletteBilevelMatteType  ? "PaletteBilevelMatte"  :
+#endif
+           "???";
+}
+#endif
+
+#if MagickLibVersion < 0x630 /* FIXME: available in 0x660, not available in 0x628, not sure which version it was introduced in */
+static ImageType MagickGetType(MagickWand *wand)
+{
+    return UndefinedType;
+}
+#endif
+
+
+static int enough_colors(MagickWand *mw, size_t colors, const struct imgmin_options *opt)
+{
+    return
+        colors >= opt->min_unique_colors ||
+        /*
+         * most color photos end up as the TrueColor type...
+         * for Grayscale we ignore color count...
+         * haven't run into many of the other types yet, be aggressive for now
+         */
+        MagickGetType(mw) != TrueColorType ||
+        /*
+         * if a full-color JPEGs has exactly 256 colors it's likely
+         * been (poorly) converted from a GIF or PNG, these often look
+         * terrible anyway but can often be compressed quite a bit
+         */
+        colors == 256;
+}
+
+/* rows exported from ImageMagick at a time by convert_row_callback() */
+#define CONVERT_ROWS        16
+
+struct convert_rows
+{
+    MagickWand *mw;
+    size_t      width,
+                height,
+                y;          /* first row in pixels */
+    int         alpha;      /* pixels are RGBA rather than RGB */
+    float      *pixels;     /* CONVERT_ROWS rows of MagickExportImagePixels() output */
+    int         failed;     /* a row couldn't be exported */
+};
+
+/**
+ * Prepares reading of given MagickWand by convert_row_callback.
+ * Returns "user_data" arg for the callback, NULL if out of memory.
+ */
+void *convert_row_start(MagickWand *mw) {
+    struct convert_rows *r = malloc(sizeof *r);
+    if (!r)
+    {
+        perror("malloc");
+        return NULL;
+    }
+    r->mw = mw;
+    r->width = MagickGetImageWidth(mw);
+    r->height = MagickGetImageHeight(mw);
+    r->y = r->height; /* nothing exported yet */
+    r->alpha = MagickGetImageAlphaChannel(mw) == MagickTrue;
+    r->failed = 0;
+    r->pixels = malloc(r->width * (r->alpha ? 4 : 3) * CONVERT_ROWS * sizeof *r->pixels);
+    if (!r->pixels)
+    {
+        perror("malloc");
+        free(r);
+        return NULL;
+    }
+    return r;
+}
+
+/**
+ * Returns 0 if a row couldn't be exported, in which case what the callback
+ * gave DSSIM is meaningless.
+ */
+int convert_row_finish(void *user_data) {
+    struct convert_rows *r = user_data;
+    const int ok = !r->failed;
+    free(r->pixels);
+    free(r);
+    return ok;
+}
+
+/*
+ * luma of width interleaved RGB floats. SSE2 takes 4 pixels (3 vectors) at a
+ * time and gathers the weighted R, G and B terms with shuffles, summing them
+ * in the same order as the scalar loop, so the result is identical
+ */
+static void luma_rgb(const float *restrict px, float *restrict luma, size_t width)
+{
+    size_t x = 0;
+
+#ifdef __SSE2__
+    const __m128 wa = _mm_setr_ps(.2126f, .7152f, .0722f, .2126f);
+    const __m128 wb = _mm_setr_ps(.7152f, .0722f, .2126f, .7152f);
+    const __m128 wc = _mm_setr_ps(.0722f, .2126f, .7152f, .0722f);
+
+    for (; x + 4 <= width; x += 4)
+    {
+        /* r0 g0 b0 r1 | g1 b1 r2 g2 | b2 r3 g3 b3, already weighted */
+        const __m128 a = _mm_mul_ps(_mm_loadu_ps(px + 3*x), wa);
+        const __m128 b = _mm_mul_ps(_mm_loadu_ps(px + 3*x + 4), wb);
+        const __m128 c = _mm_mul_ps(_mm_loadu_ps(px + 3*x + 8), wc);
+        const __m128 r = _mm_shuffle_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 3, 0, 0)),
+                                        _mm_shuffle_ps(b, c, _MM_SHUFFLE(1, 1, 2, 2)), _MM_SHUFFLE(2, 0, 2, 0));
+        const __m128 g = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(0, 0, 1, 1)),
+                                        _mm_shuffle_ps(b, c, _MM_SHUFFLE(2, 2, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+        const __m128 bl = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 1, 2, 2)),
+                                         _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 3, 0, 0)), _MM_SHUFFLE(2, 0, 2, 0));
+        _mm_storeu_ps(luma + x, _mm_add_ps(_mm_add_ps(r, g), bl));
+    }
+#endif
+    for (; x < width; x++)
+    {
+        luma[x] = .2126f * px[3*x] + .7152f * px[3*x+1] + .0722f * px[3*x+2];
+    }
 }
 
-static unsigned long quality(MagickWand *mw)
-{
-    return GetImageFromMagickWand(mw)->quality;
-}
+/*
+ * same for RGBA, premultiplied by alpha; SSE2 transposes 4 pixels at a time
+ */
+static void luma_rgba(const float *restrict px, float *restrict luma, size_t width)
+{
+    size_t x = 0;
+
+#ifdef __SSE2__
+    const __m128 wr = _mm_set1_ps(.2126f), wg = _mm_set1_ps(.7152f), wb = _mm_set1_ps(.0722f);
+
+    for (; x + 4 <= width; x += 4)
+    {
+        __m128 r = _mm_loadu_ps(px + 4*x), g = _mm_loadu_ps(px + 4*x + 4),
+               b = _mm_loadu_ps(px + 4*x + 8), a = _mm_loadu_ps(px + 4*x + 12);
+        _MM_TRANSPOSE4_PS(r, g, b, a);
+        _mm_storeu_ps(luma + x, _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(r, wr), _mm_mul_ps(g, wg)),
+                                                      _mm_mul_ps(b, wb)), a));
+    }
+#endif
+    for (; x < width; x++)
+    {
+        luma[x] = (.2126f * px[4*x] + .7152f * px[4*x+1] + .0722f * px[4*x+2]) * px[4*x+3];
+    }
+}
+
+/**
+ * Converts a single row of the MagickWand into luma channel needed by DSSIM.
+ * Rows are exported CONVERT_ROWS at a time as floats, which saves the
+ * PixelWand calls and double conversions per pixel of a PixelIterator
+ */
+void convert_row_callback(const dssim_info *const inf, float *const channels[], const int num_channels, const int y, const int orig_width, void *user_data) {
+    struct convert_rows *r = user_data;
+    const size_t width = min((size_t)orig_width, r->width);
+
+    if (r->failed)
+    {
+        memset(channels[0], 0, width * sizeof *channels[0]);
+        return;
+    }
+    if ((size_t)y < r->y || (size_t)y >= r->y + CONVERT_ROWS)
+    {
+        r->y = y;
+        if (MagickExportImagePixels(r->mw, 0, r->y, r->width, min(CONVERT_ROWS, r->height - r->y),
+                                    r->alpha ? "RGBA" : "RGB", FloatPixel, r->pixels) != MagickTrue)
+        {
+            /* DSSIM can't be told; the rest is blanked and convert_row_finish() reports it */
+            PrintWandException(r->mw);
+            r->failed = 1;
+            memset(channels[0], 0, width * sizeof *channels[0]);
+            return;
+        }
+    }
+
+    // Ideally it should be reading luma directly from JPEG
+    // Only one channel (luma) is written for speed/simplicity sake.
+    // I'm assuming IM gives perceptually uniform values
+    if (r->alpha)
+    {
+        luma_rgba(r->pixels + (y - r->y) * r->width * 4, channels[0], width);
+    } else {
+        luma_rgb(r->pixels + (y - r->y) * r->width * 3, channels[0], width);
+    }
+}
+
+/*
+ * decode an encoded image into a new wand, NULL on failure
+ */
+static MagickWand * decode_blob(const unsigned char *blob, size_t size)
+{
+    MagickWand *out;
+    if (!blob)
+    {
+        return NULL;
+    }
+    out = NewMagickWand();
+    if (MagickReadImageBlob(out, blob, size) != MagickTrue)
+    {
+        PrintWandException(out);
+        out = DestroyMagickWand(out);
+    }
+    return out;
+}
+
+/*
+ * move a malloc()ed buffer into ImageMagick memory, which is what every
+ * encoded image handed around here is released as. buf is freed either way;
+ * NULL if out of memory
+ */
+static unsigned char * magick_blob(unsigned char *buf, size_t size)
+{
+    unsigned char *blob = AcquireMagickMemory(size);
+    if (!blob)
+    {
+        perror("AcquireMagickMemory");
+    } else {
+        memcpy(blob, buf, size);
+    }
+    free(buf);
+    return blob;
+}
+
+/*
+ * libjpeg encoder over a copy of mw's pixels, to encode the search's
+ * candidates without copying the image for each thread (see JPEGENC).
+ * NULL if mw isn't an RGB or grayscale JPEG; ImageMagick encodes those.
+ * the output settings are those search_quality() gives mw: stripped, with
+ * 2x2 chroma subsampling
+ */
+static jpegenc * candidate_encoder(MagickWand *mw)
+{
+    const size_t width = MagickGetImageWidth(mw);
+    const size_t height = MagickGetImageHeight(mw);
+    char *format = MagickGetImageFormat(mw);
+    const int jpeg = format && !strcmp("JPEG", format);
+    int components;
+    unsigned char *pixels;
+    jpegenc *enc;
+
+    (void) MagickRelinquishMemory(format);
+    if (!jpeg || MagickGetImageColorspace(mw) == CMYKColorspace)
+    {
+        return NULL;
+    }
+
+    /* like ImageMagick, write gray images as single-component JPEGs */
+    {
+        const ImageType t = MagickGetImageType(mw);
+        components = t == GrayscaleType || t == BilevelType ? 1 : 3;
+    }
+    pixels = malloc(width * height * components);
+    if (!pixels || MagickExportImagePixels(mw, 0, 0, width, height, components == 1 ? "I" : "RGB",
+                                           CharPixel, pixels) != MagickTrue)
+    {
+        free(pixels);
+        return NULL;
+    }
+    enc = jpegenc_open(pixels, width, height, components);
+    if (!enc)
+    {
+        free(pixels);
+        return NULL;
+    }
+
+    jpegenc_set_progressive(enc, MagickGetImageInterlaceScheme(mw) != NoInterlace);
+    {
+        const ResolutionType units = MagickGetImageUnits(mw);
+        double x = 0, y = 0;
+        (void) MagickGetImageResolution(mw, &x, &y);
+        jpegenc_set_density(enc,
+                            units == PixelsPerInchResolution ? 1 :
+                            units == PixelsPerCentimeterResolution ? 2 : 0,
+                            (unsigned)floor(x + 0.5), (unsigned)floor(y + 0.5));
+    }
+    return enc;
+}
+
+/*
+ * encode mw at quality q, with enc when given, into an in-memory blob to be
+ * released with MagickRelinquishMemory(). without enc ImageMagick encodes mw
+ * itself at q, and mw's quality is put back afterwards.
+ * NULL on failure
+ */
+static unsigned char * encode_blob(MagickWand *mw, const jpegenc *enc, unsigned q, size_t *size)
+{
+    unsigned char *buf;
+
+    *size = 0;
+    if (enc)
+    {
+        buf = jpegenc_encode(enc, q, size);
+        if (buf)
+        {
+            buf = magick_blob(buf, *size);
+        }
+        if (!buf)
+        {
+            *size = 0;
+        }
+    } else {
+        const size_t q_mw = MagickGetImageCompressionQuality(mw);
+        MagickSetImageCompressionQuality(mw, q);
+        buf = MagickGetImageBlob(mw, size);
+        MagickSetImageCompressionQuality(mw, q_mw);
+    }
+    return buf;
+}
+
+/*
+ * encode mw at quality q as encode_blob() does and decode the result into a
+ * new wand, NULL if either fails. both directions go through an in-memory
+ * blob; nothing touches the filesystem.
+ * the encoded image is handed back in *blob when that's given, to be released
+ * with MagickRelinquishMemory()
+ */
+static MagickWand * encode_decode(MagickWand *mw, const jpegenc *enc, unsigned q,
+                                  unsigned char **blob, size_t *size)
+{
+    size_t enc_size;
+    unsigned char *buf = encode_blob(mw, enc, q, &enc_size);
+    MagickWand *out = decode_blob(buf, enc_size);
+
+    if (blob)
+    {
+        *blob = buf;
+        *size = enc_size;
+    } else {
+        (void) MagickRelinquishMemory(buf);
+    }
+    return out;
+}
+
+/*
+ * a single point in quality space evaluated by search_quality()
+ */
+struct candidate
+{
+    unsigned q;
+    double   error,
+             density_ratio;
+    int      bound;     /* error is only a lower (1) or upper (-1) bound, or an estimate over (1) or under (-1) the threshold, see measure_candidate() */
+    size_t   colors;    /* unique colors of the candidate, 0 if they weren't counted */
+};
+
+/*
+ * state shared read-only by every candidate evaluated for one image
+ */
+struct search_ctx
+{
+    size_t width,
+           height;
+    double original_density;
+    jpegq *jq; /* set when searching in the DCT coefficient domain */
+    const jpegenc *enc; /* encodes pixel candidates, if set */
+    int luma;           /* enc's candidates are decoded to luma only */
+    int stream;         /* candidates are compared with dssim_compare_stream() */
+    const struct imgmin_options *opt;
+};
+
+/*
+ * each worker owns its own DSSIM state so that candidates can be evaluated
+ * concurrently. workers share the source wand when ctx->enc does the
+ * encoding; otherwise ImageMagick sets the quality on the wand it encodes,
+ * so all but worker 0 get a copy, and worker 0 puts the source's quality
+ * back after each candidate (see encode_blob())
+ */
+struct search_worker
+{
+    pthread_t thread;
+    MagickWand *mw;
+    dssim_info *dssim;
+    const struct search_ctx *ctx;
+    struct candidate *cand;
+    unsigned char *blob;        /* cand encoded, kept in case it wins */
+    size_t size;
+    uint32_t *colors;           /* count_colors() bitset */
+    int failed;                 /* cand couldn't be measured */
+};
+
+/*
+ * compare the candidate loaded into w->dssim with the original band by band,
+ * and stop as soon as it's certain which side of the threshold's
+ * +/-ERROR_THRESHOLD_INACCURACY band the error lands on; finish_round() then
+ * decides the same as it would on the exact error. a candidate cut short
+ * gets the bound that decided it as its error. with --early-verdict the
+ * estimate from the bands so far may decide first, see EARLY_VERDICT.
+ * the --pyramid levels are tried before all that, and only reject; their
+ * error is an estimate, see PYRAMID
+ */
+static void measure_candidate(struct search_worker *w, double fudge)
+{
+    const double threshold = w->ctx->opt->error_threshold;
+    struct candidate *c = w->cand;
+    double lo, hi;
+    int more, level;
+
+    for (level = dssim_pyramid_levels(w->dssim); level > 0; level--)
+    {
+        lo = dssim_compare_level(w->dssim, level) * 20.0 * fudge;
+        if (isnan(lo))
+        {
+            w->failed = 1;
+            return;
+        }
+        if (lo > threshold * PYRAMID_MARGIN)
+        {
+            c->error = lo;
+            c->bound = 1;
+            return;
+        }
+    }
+
+    do {
+        more = dssim_compare_band(w->dssim, &lo, &hi);
+        if (more < 0)
+        {
+            w->failed = 1;
+            return;
+        }
+        /* scaled to threshold of previous implementation */
+        lo *= 20.0 * fudge;
+        hi *= 20.0 * fudge;
+        if (more && lo > threshold * (1 + ERROR_THRESHOLD_INACCURACY))
+        {
+            c->error = lo;
+            c->bound = 1;
+            return;
+        }
+        if (more && hi < threshold * (1 - ERROR_THRESHOLD_INACCURACY))
+        {
+            c->error = hi;
+            c->bound = -1;
+            return;
+        }
+        if (more && w->ctx->opt->early_verdict)
+        {
+            double compared;
+            const double est = dssim_band_estimate(w->dssim, &compared) * 20.0 * fudge;
+            if (compared >= EARLY_COMPARED &&
+                (est > threshold * EARLY_MARGIN || est < threshold / EARLY_MARGIN))
+            {
+                c->error = est;
+                c->bound = est > threshold ? 1 : -1;
+                return;
+            }
+        }
+    } while (more);
+    c->error = lo;
+    c->bound = 0;
+}
+
+/*
+ * measure the candidate read by modified_cb against the original read by
+ * original_cb, a row at a time
+ */
+static void measure_stream(struct search_worker *w, dssim_row_callback original_cb, void *original,
+                           dssim_row_callback modified_cb, void *modified)
+{
+    const struct search_ctx *ctx = w->ctx;
+    struct candidate *c = w->cand;
+
+    c->error = dssim_compare_stream(w->dssim, ctx->width, ctx->height,
+                                    original_cb, original, modified_cb, modified) * 20.0;
+    c->bound = 0;
+    w->failed |= isnan(c->error);
+}
+
+/*
+ * encode the source image at quality cand->q and measure how far it strays from the original
+ */
+static void evaluate_candidate(struct search_worker *w)
+{
+    const struct search_ctx *ctx = w->ctx;
+    struct candidate *c = w->cand;
+
+    if (ctx->jq)
+    {
+        /*
+         * requantized luma straight from the coefficients; colors are never
+         * reconstructed so the color density check does not apply
+         */
+        void *rows = jpegq_luma_start(ctx->jq, c->q);
+        c->density_ratio = 0;
+        c->colors = 0;
+        if (!rows)
+        {
+            w->failed = 1;
+            return;
+        }
+        if (ctx->stream)
+        {
+            void *original = jpegq_luma_start(ctx->jq, 0);
+            if (original)
+            {
+                measure_stream(w, jpegq_luma_row, original, jpegq_luma_row, rows);
+                jpegq_luma_finish(original);
+            } else {
+                w->failed = 1;
+            }
+            jpegq_luma_finish(rows);
+            return;
+        }
+        w->failed = dssim_set_modified_float_callback(w->dssim, ctx->width, ctx->height, jpegq_luma_row, rows);
+        jpegq_luma_finish(rows);
+        if (!w->failed)
+        {
+            measure_candidate(w, 1.0);
+        }
+        return;
+    }
+
+    if (ctx->luma)
+    {
+        /* same for luma decoded from the candidate; it's kept in case it wins */
+        unsigned char *buf = jpegenc_encode(ctx->enc, c->q, &w->size);
+        void *rows = buf ? jpegenc_luma_start(ctx->enc, buf, w->size) : NULL;
+        if (!rows)
+        {
+            fprintf(stderr, "Failed to encode quality %u\n", c->q);
+            free(buf);
+            w->failed = 1;
+            return;
+        }
+        c->density_ratio = 0;
+        c->colors = 0;
+        if (ctx->stream)
+        {
+            void *original = jpegenc_luma_start(ctx->enc, NULL, 0);
+            if (!original)
+            {
+                jpegenc_luma_finish(rows);
+                free(buf);
+                w->failed = 1;
+                return;
+            }
+            measure_stream(w, jpegenc_luma_row, original, jpegenc_luma_row, rows);
+            jpegenc_luma_finish(original);
+        } else {
+            w->failed = dssim_set_modified_float_callback(w->dssim, ctx->width, ctx->height, jpegenc_luma_row, rows);
+            if (!w->failed)
+            {
+                measure_candidate(w, 1.0);
+            }
+        }
+        jpegenc_luma_finish(rows);
+        w->blob = magick_blob(buf, w->size);
+        return;
+    }
+
+    /* apply quality change */
+    MagickWand *tmp = encode_decode(w->mw, ctx->enc, c->q, &w->blob, &w->size);
+    double fudge = 1.0;
+
+    if (!tmp)
+    {
+        fprintf(stderr, "Failed to encode quality %u\n", c->q);
+        w->failed = 1;
+        return;
+    }
+    void *convert_data = convert_row_start(tmp);
+    if (!convert_data)
+    {
+        w->failed = 1;
+        DestroyMagickWand(tmp);
+        return;
+    }
+    w->failed = dssim_set_modified_float_callback(w->dssim, ctx->width, ctx->height, convert_row_callback, convert_data);
+    if (!convert_row_finish(convert_data) || w->failed)
+    {
+        w->failed = 1;
+        DestroyMagickWand(tmp);
+        return;
+    }
+
+    c->colors = count_colors(tmp, w->colors);
+    c->density_ratio = fabs(color_density(tmp, c->colors) - ctx->original_density) / ctx->original_density;
+    DestroyMagickWand(tmp);
+
+    /* color density ratio threshold is an alternative quality measure.
+       If it's exceeded, pretend MSE was higher to increase quality */
+    if (c->density_ratio > ctx->opt->color_density_ratio) {
+        fudge = 1.25 + c->density_ratio; // fudge factor
+    }
+    measure_candidate(w, fudge);
+}
+
+static void * evaluate_candidate_thread(void *arg)
+{
+    evaluate_candidate((struct search_worker *)arg);
+    return NULL;
+}
+
+/*
+ * evaluate cand[0..n) with one worker each; worker 0 runs on the calling thread,
+ * as does any worker whose thread couldn't be started
+ */
+static void evaluate_round(struct search_worker *workers, struct candidate *cand, unsigned n)
+{
+    int started[THREADS_MAX];
+    unsigned i;
+    for (i = 0; i < n; i++)
+    {
+        workers[i].cand = cand + i;
+    }
+    for (i = 1; i < n; i++)
+    {
+        started[i] = !pthread_create(&workers[i].thread, NULL, evaluate_candidate_thread, workers + i);
+    }
+    evaluate_candidate(workers);
+    for (i = 1; i < n; i++)
+    {
+        if (started[i])
+        {
+            (void) pthread_join(workers[i].thread, NULL);
+        } else {
+            evaluate_candidate(workers + i);
+        }
+    }
+}
+
+/*
+ * where the search stands between rounds: qmin is known (or assumed) to
+ * exceed the error threshold and qmax to be within it
+ */
+struct search_state
+{
+    unsigned qmin,
+             qmax;
+    unsigned seeds[2];          /* qualities to try first, e.g. the proxy's answer */
+    unsigned nseeds;
+    struct candidate lo, hi;    /* measurements at qmin/qmax, if any */
+    int have_lo,
+        have_hi;
+    struct candidate last[2];   /* the two most recent measurements */
+    unsigned nlast;
+    int side;                   /* bound moved by the last round: -1 qmin, 1 qmax, 0 both */
+    unsigned stale;             /* further rounds in a row that moved the same bound */
+    unsigned char *blob;        /* qmax as encoded by the search, if it was */
+    size_t size;
+    size_t colors;              /* blob's unique colors, 0 if they weren't counted */
+};
+
+/*
+ * quality at which the straight line through a and b crosses threshold,
+ * kept strictly inside (qmin, qmax); 0 if there is no usable line.
+ * errors of candidates cut short are bounds, which skew the line towards the
+ * threshold; it only picks where to look next, so that is harmless
+ */
+static unsigned secant_quality(const struct candidate *a, const struct candidate *b,
+                               double threshold, unsigned qmin, unsigned qmax)
+{
+    double q;
+
+    if (a->q == b->q || a->error == b->error)
+        return 0;
+    q = a->q + (threshold - a->error) * ((double)b->q - a->q) / (b->error - a->error);
+    if (!isfinite(q))
+        return 0;
+    q = floor(q + 0.5);
+    q = max(q, qmin + 1);
+    q = min(q, qmax - 1);
+    return (unsigned)q;
+}
+
+/*
+ * pick up to k qualities to evaluate next, in ascending order; returns how many
+ */
+static unsigned plan_round(struct search_state *st, struct candidate *cand, unsigned k,
+                           const struct imgmin_options *opt)
+{
+    const unsigned span = st->qmax - st->qmin;
+    unsigned n = 0;
+    unsigned i, j;
+
+    /* seeded qualities go first, one per worker */
+    while (st->nseeds > 0 && n < k)
+    {
+        const unsigned q = st->seeds[--st->nseeds];
+        if (q > st->qmin && q < st->qmax)
+        {
+            cand[n++].q = q;
+        }
+    }
+
+    /*
+     * interpolate the error curve, from the bracketing measurements when we
+     * have both, else from the two latest. when one bound keeps moving on its
+     * own the line is a poor fit (regula falsi stalls), so bisect instead
+     */
+    if (n == 0 && opt->search == SEARCH_SECANT && st->stale < 2)
+    {
+        unsigned q = 0;
+        if (st->have_lo && st->have_hi)
+            q = secant_quality(&st->lo, &st->hi, opt->error_threshold, st->qmin, st->qmax);
+        else if (st->nlast == 2)
+            q = secant_quality(&st->last[0], &st->last[1], opt->error_threshold, st->qmin, st->qmax);
+        /* spare workers take the neighbours of the estimate: q, q-1, q+1, q-2... */
+        for (j = 0; q && n < k && j < 2 * span; j++)
+        {
+            const int d = (int)(j + 1) / 2;
+            const int qq = (int)q + (j & 1 ? -d : d);
+            if (qq > (int)st->qmin && qq < (int)st->qmax)
+            {
+                cand[n++].q = (unsigned)qq;
+            }
+        }
+    }
+
+    /* evenly spaced k-ary split; k=1 is a plain bisection */
+    if (n == 0)
+    {
+        n = min(k, span - 1);
+        for (i = 0; i < n; i++)
+        {
+            cand[i].q = st->qmin + (i + 1) * span / (n + 1);
+        }
+    }
+
+    /* insertion sort, n <= THREADS_MAX */
+    for (i = 1; i < n; i++)
+    {
+        const unsigned q = cand[i].q;
+        for (j = i; j > 0 && cand[j-1].q > q; j--)
+        {
+            cand[j].q = cand[j-1].q;
+        }
+        cand[j].q = q;
+    }
+    return n;
+}
+
+/*
+ * narrow [qmin, qmax] to the gap the answer lies in given the round's results.
+ * returns non-zero once a candidate is close enough to the target to stop
+ */
+static int finish_round(struct search_state *st, const struct candidate *cand, unsigned n,
+                        const struct imgmin_options *opt)
+{
+    int found = -1;
+    int done = 0;
+    unsigned i;
+
+    /* the lowest quality within thresholds, or close enough to the target, wins */
+    for (i = 0; i < n && found < 0; i++)
+    {
+        /* Stop searching if close enough to the target */
+        done = fabs(cand[i].error - opt->error_threshold) < opt->error_threshold * ERROR_THRESHOLD_INACCURACY;
+        if (done || cand[i].error <= opt->error_threshold)
+        {
+            found = (int)i;
+        }
+    }
+
+    /* eliminate all but one gap of the search space based on whether distortion within thresholds */
+    if (found < 0)
+    {
+        st->qmin = cand[n-1].q;
+        st->lo = cand[n-1];
+        st->have_lo = 1;
+    } else {
+        st->qmax = cand[found].q;
+        st->hi = cand[found];
+        st->have_hi = 1;
+        if (found > 0)
+        {
+            st->qmin = cand[found-1].q;
+            st->lo = cand[found-1];
+            st->have_lo = 1;
+        }
+    }
+    {
+        const int side = found < 0 ? -1 : found == 0 ? 1 : 0;
+        st->stale = side && side == st->side ? st->stale + 1 : 0;
+        st->side = side;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        st->last[0] = st->last[1];
+        st->last[1] = cand[i];
+        st->nlast = min(2, st->nlast + 1);
+    }
+    return done;
+}
+
+/*
+ * run up to max_rounds rounds of the search on mw (or on jq's coefficients
+ * when given), narrowing st. density is mw's color density.
+ * candidates are encoded with enc when given.
+ * returns 0 if the original or a candidate couldn't be measured; st is
+ * then only as far as the rounds before got it
+ */
+static int search_rounds(MagickWand *mw, double density, jpegq *jq, const jpegenc *enc,
+                          struct search_state *st, unsigned max_rounds,
+                          const struct imgmin_options *opt)
+{
+    struct search_ctx ctx;
+    struct search_worker workers[THREADS_MAX];
+    struct candidate cand[THREADS_MAX];
+    unsigned k = max(1, min(THREADS_MAX, opt->threads));
+    unsigned rounds = 0;
+    unsigned candidates = 0;
+    unsigned i;
+    int done;
+    int ok = 1;
+
+    ctx.width = MagickGetImageWidth(mw);
+    ctx.height = MagickGetImageHeight(mw);
+    ctx.opt = opt;
+    ctx.jq = jq;
+    ctx.enc = enc;
+    ctx.luma = enc && !jq && opt->luma_decode;
+    ctx.stream = (jq || ctx.luma) && opt->stream_mp &&
+                 (double)ctx.width * ctx.height >= opt->stream_mp * 1e6;
+    ctx.original_density = density;
+
+    dssim_info *dssim = dssim_init(1);
+    if (!dssim)
+    {
+        return 0;
+    }
+    dssim_set_threads(dssim, opt->dssim_threads);
+    dssim_set_pyramid(dssim, opt->pyramid);
+    dssim_set_compact(dssim, opt->compact);
+
+    if (ctx.stream)
+    {
+        /* the original is read again with each candidate */
+    } else if (jq) {
+        /* measure against the same luma reconstruction the candidates get */
+        void *rows = jpegq_luma_start(jq, 0);
+        if (rows)
+        {
+            ok = !dssim_set_original_float_callback(dssim, ctx.width, ctx.height, jpegq_luma_row, rows);
+            jpegq_luma_finish(rows);
+        } else {
+            ok = 0;
+        }
+    } else if (ctx.luma) {
+        void *rows = jpegenc_luma_start(enc, NULL, 0);
+        if (rows)
+        {
+            ok = !dssim_set_original_float_callback(dssim, ctx.width, ctx.height, jpegenc_luma_row, rows);
+            jpegenc_luma_finish(rows);
+        } else {
+            ok = 0;
+        }
+    } else {
+        void *convert_data = convert_row_start(mw);
+        if (convert_data)
+        {
+            ok = !dssim_set_original_float_callback(dssim, ctx.width, ctx.height, convert_row_callback, convert_data);
+            ok &= convert_row_finish(convert_data);
+        } else {
+            ok = 0;
+        }
+    }
+
+    /*
+     * worker 0 uses our own state, the rest get private copies; with too
+     * little memory for those there are just fewer workers
+     */
+    if (!ok)
+    {
+        k = 1;
+    }
+    for (i = 0; i < k; i++)
+    {
+        workers[i].mw = i && !enc && !jq ? CloneMagickWand(mw) : mw;
+        workers[i].dssim = i ? dssim_clone(dssim) : dssim;
+        workers[i].ctx = &ctx;
+        workers[i].blob = NULL;
+        workers[i].failed = 0;
+        /* the requantized and luma-only searches never look at colors */
+        workers[i].colors = jq || ctx.luma ? NULL : calloc(COLOR_BITS_WORDS, sizeof *workers[i].colors);
+        if (i && (!workers[i].mw || !workers[i].dssim || (!jq && !ctx.luma && !workers[i].colors)))
+        {
+            if (workers[i].mw && workers[i].mw != mw)
+            {
+                DestroyMagickWand(workers[i].mw);
+            }
+            if (workers[i].dssim)
+            {
+                dssim_dealloc(workers[i].dssim);
+            }
+            free(workers[i].colors);
+            k = i;
+            break;
+        }
+        if (!jq && !ctx.luma && !workers[i].colors)
+        {
+            ok = 0;
+        }
+    }
 
-static double color_density(MagickWand *mw)
-{
-    const size_t area = MagickGetImageHeight(mw) * MagickGetImageWidth(mw);
-    double density = (double)unique_colors(mw) / area;
-    return density;
-}
+    /*
+     * search quality space for the optimally lowest quality that produces
+     * an acceptable level of distortion.
+     * each round evaluates up to k qualities in parallel and narrows
+     * [qmin, qmax] to the gap between two neighbours; see plan_round()
+     * for how they are picked.
+     */
+    while (ok && st->qmax > st->qmin + 1 && rounds < max_rounds)
+    {
+        const unsigned n = plan_round(st, cand, k, opt);
 
-#define min(a,b) ((a) < (b) ? (a) : (b))
-#define max(a,b) ((a) > (b) ? (a) : (b))
+        rounds++;
+        evaluate_round(workers, cand, n);
+        candidates += n;
 
+        for (i = 0; i < n; i++)
+        {
+            ok &= !workers[i].failed;
+        }
+        if (!ok)
+        {
+            for (i = 0; i < n; i++)
+            {
+                (void) MagickRelinquishMemory(workers[i].blob);
+                workers[i].blob = NULL;
+            }
+            break;
+        }
 
-#ifndef IMGMIN_LIB
-static const char * type2str(const ImageType t)
-{
-    return
-           t == UndefinedType            ? "Undefined"            :
-           t == BilevelType              ? "Bilevel"              :
-           t == GrayscaleType            ? "Grayscale"            :
-           t == GrayscaleMatteType       ? "GrayscaleMatte"       :
-           t == PaletteType              ? "Palette"              :
-           t == PaletteMatteType         ? "PaletteMatte"         :
-           t == TrueColorType            ? "TrueColor"            :
-           t == TrueColorMatteType       ? "TrueColorMatte"       :
-           t == ColorSeparationType      ? "ColorSeparation"      :
-           t == ColorSeparationMatteType ? "ColorSeparationMatte" :
-           t == OptimizeType             ? "Optimize"             :
-#if MagickLibVersion >= 0x630 /* FIXME: available in 0x660, not available in 0x628, not sure which version it was introduced in */
-           t == PaletteBilevelMatteType  ? "PaletteBilevelMatte"  :
-#endif
-           "???";
-}
-#endif
+        for (i = 0; i < n; i++)
+        {
+            if (opt->show_progress)
+            {
+                fprintf(stdout, "%s%.2f/%.2f@%u ", cand[i].bound > 0 ? ">" : cand[i].bound < 0 ? "<" : "",
+                        cand[i].error, cand[i].density_ratio, cand[i].q);
+            }
+        }
 
-#if MagickLibVersion < 0x630 /* FIXME: available in 0x660, not available in 0x628, not sure which version it was introduced in */
-static ImageType MagickGetType(MagickWand *wand)
-{
-    return UndefinedType;
-}
-#endif
+        done = finish_round(st, cand, n, opt);
 
+        /* keep the encoding of the new qmax, if there is one; it's the output should the search end here */
+        for (i = 0; i < n; i++)
+        {
+            if (workers[i].blob && cand[i].q == st->qmax)
+            {
+                (void) MagickRelinquishMemory(st->blob);
+                st->blob = workers[i].blob;
+                st->size = workers[i].size;
+                st->colors = cand[i].colors;
+            } else {
+                (void) MagickRelinquishMemory(workers[i].blob);
+            }
+            workers[i].blob = NULL;
+        }
+        if (done)
+        {
+            break;
+        }
+    }
+    if (opt->show_progress)
+    {
+        if (k > 1)
+        {
+            fprintf(stdout, "(%u rounds, %u candidates) ", rounds, candidates);
+        } else {
+            fprintf(stdout, "(%u steps) ", rounds);
+        }
+    }
 
-static int enough_colors(MagickWand *mw, const struct imgmin_options *opt)
-{
-    return
-        unique_colors(mw) >= opt->min_unique_colors ||
-        /*
-         * most color photos end up as the TrueColor type...
-         * for Grayscale we ignore color count...
-         * haven't run into many of the other types yet, be aggressive for now
-         */
-        MagickGetType(mw) != TrueColorType ||
-        /*
-         * if a full-color JPEGs has exactly 256 colors it's likely
-         * been (poorly) converted from a GIF or PNG, these often look
-         * terrible anyway but can often be compressed quite a bit
-         */
-        unique_colors(mw) == 256;
+    for (i = 0; i < k; i++)
+    {
+        if (workers[i].mw != mw)
+        {
+            DestroyMagickWand(workers[i].mw);
+        }
+        dssim_dealloc(workers[i].dssim);
+        free(workers[i].colors);
+    }
+    return ok;
 }
 
-/**
- * Prepares reading of given MagickWand by convert_row_callback.
- * Returns "user_data" arg for the callback.
+/*
+ * a copy of mw downscaled by opt->proxy_scale to run the search on, or NULL
+ * when the image is too small to bother.
+ * JPEGs are decoded again with libjpeg's DCT scaling (the "jpeg:size" hint),
+ * which skips most of the IDCT work instead of decoding the full frame and
+ * resampling it.
  */
-void *convert_row_start(MagickWand *mw) {
-    return NewPixelIterator(mw);
-}
-
-void convert_row_finish(void *user_data) {
-    DestroyPixelIterator((PixelIterator*)user_data);
-}
+static MagickWand * proxy_image(MagickWand *mw, const unsigned char *blob, size_t size,
+                                const struct imgmin_options *opt)
+{
+    const size_t width = MagickGetImageWidth(mw) / opt->proxy_scale;
+    const size_t height = MagickGetImageHeight(mw) / opt->proxy_scale;
+    MagickWand *proxy = NULL;
+    char *format;
 
-/**
- * Converts a single row from MagickWand iterator into luma channel needed by DSSIM
- */
-void convert_row_callback(const dssim_info *const inf, float *const channels[], const int num_channels, const int y, const int orig_width, void *user_data) {
-    size_t x, width = orig_width;
-    PixelWand **pmw = PixelGetNextIteratorRow((PixelIterator*)user_data, &width);
+    if (opt->proxy_scale < 2 || min(width, height) < PROXY_MIN_SIZE)
+    {
+        return NULL;
+    }
 
-    for(x = 0; x < width; x++) {
-        // Ideally it should be reading luma directly from JPEG
-        // Only one channel (luma) is written for speed/simplicity sake.
-        channels[0][x] = (
-            .2126 * PixelGetRed(pmw[x]) + // I'm assuming IM gives perceptually uniform values
-            .7152 * PixelGetGreen(pmw[x]) +
-            .0722 * PixelGetBlue(pmw[x])
-        ) * PixelGetAlpha(pmw[x]);
+    format = MagickGetImageFormat(mw);
+    if (blob && !strcmp("JPEG", format))
+    {
+        char hint[64];
+        snprintf(hint, sizeof hint, "%lux%lu", (unsigned long)width, (unsigned long)height);
+        proxy = NewMagickWand();
+        (void) MagickSetOption(proxy, "jpeg:size", hint);
+        if (MagickReadImageBlob(proxy, blob, size) != MagickTrue)
+        {
+            proxy = DestroyMagickWand(proxy);
+        }
+    }
+    (void) MagickRelinquishMemory(format);
+    if (proxy)
+    {
+        return proxy;
     }
+
+    proxy = CloneMagickWand(mw);
+    (void) MagickScaleImage(proxy, width, height);
+    return proxy;
 }
 
 /*
- * given a source image, a destination filepath and a set of image metadata thresholds,
+ * given a source image and a set of image metadata thresholds,
  * search for the lowest-quality version of the source image whose properties fall within our
  * thresholds.
- * this will produce an image file that looks the same to the casual observer, but which
+ * this will produce an image that looks the same to the casual observer, but which
  * contains much less information and results in a smaller file.
  * typical savings on unoptimized images vary widely from 10-80%, with 25-50% being most common.
+ * every candidate is encoded and decoded in memory; no temporary files are used.
+ * blob is the encoded source of mw; with opt->requantize JPEG candidates are
+ * produced from its DCT coefficients instead.
+ * colors is mw's unique color count if the caller has it, 0 to count them here.
+ * the result is the encoding the search settled on, as it will be written;
+ * nothing is encoded or decoded once the quality is decided. res->blob is
+ * NULL if the image was left alone.
  */
-MagickWand * search_quality(MagickWand *mw, const char *dst,
-                                   const struct imgmin_options *opt)
+void search_quality(MagickWand *mw,
+                    const unsigned char *blob, size_t size, size_t colors,
+                    struct imgmin_result *res,
+                    const struct imgmin_options *opt)
 {
-    MagickWand *tmp = NULL;
-    char tmpfile[MAX_PATH] = "/tmp/imgminXXXXXX";
-    if (0 == strcmp("-", dst))
+    double density;
+
+    /* counted once; the original's colors are needed all over */
+    if (!colors)
     {
-        if (-1 == mkstemp(tmpfile))
-        {
-            perror("mkstemp");
-            return CloneMagickWand(mw);
-        }
-    } else {
-        strcpy(tmpfile, dst);
+        colors = unique_colors(mw);
     }
+    density = color_density(mw, colors);
+
+    memset(res, 0, sizeof *res);
 
     /*
      * The overwhelming majority of JPEGs are TrueColorType; it is those types, with a low
      * unique color count, that we must avoid.
      */
-    if (!enough_colors(mw, opt))
+    if (!enough_colors(mw, colors, opt))
     {
         fprintf(stdout, " Color count is too low, skipping...\n");
-        return CloneMagickWand(mw);
+        return;
     }
 
     if (quality(mw) < opt->quality_in_min)
     {
         fprintf(stdout, " Quality < %u, won't second-guess...\n", opt->quality_in_min);
-        return CloneMagickWand(mw);
+        return;
     }
 
-    size_t width = MagickGetImageWidth(mw);
-    size_t height = MagickGetImageHeight(mw);
-
-    dssim_info *dssim = dssim_init(1);
-
-    void *convert_data = convert_row_start(mw);
-    dssim_set_original_float_callback(dssim, width, height, convert_row_callback, convert_data);
-    convert_row_finish(convert_data);
-
     {
         ExceptionInfo *exception = AcquireExceptionInfo();
+        jpegq *jq = opt->requantize ? jpegq_open(blob, size) : NULL;
+        /* requantized candidates are already cheap, and don't survive downscaling */
+        MagickWand *proxy = jq ? NULL : proxy_image(mw, blob, size, opt);
+        jpegenc *enc = NULL;
+        struct search_state st;
+        int ok;
 
-        const double original_density = color_density(mw);
-        unsigned qmax = min(quality(mw), opt->quality_out_max);
-        unsigned qmin = opt->quality_out_min;
-        unsigned steps = 0;
+        memset(&st, 0, sizeof st);
+        st.qmax = min(quality(mw), opt->quality_out_max);
+        st.qmin = opt->quality_out_min;
 
         /*
-         * binary search of quality space for optimally lowest quality that
-         * produces an acceptable level of distortion
+         * candidates are encoded the way the output will be, so that the
+         * winner's encoding can be written as is
          */
-        while (qmax > qmin + 1 && steps < opt->max_steps)
-        {
-            double density_ratio;
-            unsigned q;
-
-            steps++;
-            q = (qmax + qmin) / 2;
-
-            /* change quality */
-            tmp = CloneMagickWand(mw);
-            MagickSetImageCompressionQuality(tmp, q);
 
-            /* apply quality change */
-            MagickWriteImages(tmp, tmpfile, MagickTrue);
-            DestroyMagickWand(tmp);
-            tmp = NewMagickWand();
-            MagickReadImage(tmp, tmpfile);
-
-            void *convert_data = convert_row_start(tmp);
-            dssim_set_modified_float_callback(dssim, width, height, convert_row_callback, convert_data);
-            convert_row_finish(convert_data);
+        /* "Chroma sub-sampling works because human vision is relatively insensitive to
+         * small areas of colour. It gives a significant reduction in file sizes, with
+         * little loss of perceived quality." [3]
+         */
+#if MagickLibVersion >= 0x630 /* FIXME: available in 0x660, not available in 0x628, not sure which version it was introduced in */
+        (void) MagickSetImageProperty(mw, "jpeg:sampling-factor", "2x2");
+#endif
 
-            double error = 20.0 * dssim_compare(dssim, NULL); // scaled to threshold of previous implementation
+        /* strip an image of all profiles and comments */
+        (void) MagickStripImage(mw);
 
-            density_ratio = fabs(color_density(tmp) - original_density) / original_density;
+        if (!jq && (opt->jpegenc || opt->luma_decode))
+        {
+            enc = candidate_encoder(mw);
+        }
 
-            /* color density ratio threshold is an alternative quality measure.
-               If it's exceeded, pretend MSE was higher to increase quality */
-            if (density_ratio > opt->color_density_ratio) {
-                error *= 1.25 + density_ratio; // fudge factor
+        if (proxy)
+        {
+            /*
+             * search the proxy, then confirm its answer at full resolution by
+             * probing q and q-1. that closes the range when the proxy was
+             * right; when it was wrong the steps left bisect what remains
+             */
+            struct search_state pst = st;
+            jpegenc *proxy_enc = enc ? candidate_encoder(proxy) : NULL;
+            if (opt->show_progress)
+            {
+                fprintf(stdout, "1/%u: ", opt->proxy_scale);
             }
-
-            /* eliminate half search space based on whether distortion within thresholds */
-            if (error > opt->error_threshold)
+            /* a proxy that couldn't be measured just gives no hint */
+            ok = search_rounds(proxy, color_density(proxy, unique_colors(proxy)), NULL, proxy_enc,
+                               &pst, opt->max_steps, opt);
+            jpegenc_close(proxy_enc);
+            DestroyMagickWand(proxy);
+            (void) MagickRelinquishMemory(pst.blob);
+
+            st.nseeds = 0;
+            if (ok)
             {
-                qmin = q;
-            } else {
-                qmax = q;
+                st.seeds[st.nseeds++] = pst.qmax - 1;
+                st.seeds[st.nseeds++] = pst.qmax;
             }
             if (opt->show_progress)
             {
-                fprintf(stdout, "%.2f/%.2f@%u ", error, density_ratio, q);
-            }
-
-            /* Stop searching if close enough to the target */
-            if (fabs(error - opt->error_threshold) < opt->error_threshold * ERROR_THRESHOLD_INACCURACY) {
-                qmax = q;
-                break;
+                fprintf(stdout, "1/1: ");
             }
+            ok = search_rounds(mw, density, NULL, enc, &st, opt->max_steps, opt);
+        } else {
+            ok = search_rounds(mw, density, jq, enc, &st, opt->max_steps, opt);
         }
         if (opt->show_progress)
         {
             putc('\n', stdout);
         }
 
-        MagickSetImageCompressionQuality(mw, qmax);
-
-        /* "Chroma sub-sampling works because human vision is relatively insensitive to
-         * small areas of colour. It gives a significant reduction in file sizes, with
-         * little loss of perceived quality." [3]
-         */
-#if MagickLibVersion >= 0x630 /* FIXME: available in 0x660, not available in 0x628, not sure which version it was introduced in */
-        (void) MagickSetImageProperty(mw, "jpeg:sampling-factor", "2x2");
-#endif
+        if (!ok)
+        {
+            /* res->blob stays NULL, so the original is kept */
+            fprintf(stdout, " Failed to measure candidates, leaving the image alone\n");
+            (void) MagickRelinquishMemory(st.blob);
+            jpegq_close(jq);
+            jpegenc_close(enc);
+            exception = DestroyExceptionInfo(exception);
+            return;
+        }
 
-        /* strip an image of all profiles and comments */
-        (void) MagickStripImage(mw);
+        if (jq)
+        {
+            /*
+             * only the winner is entropy-coded. it keeps the original's chroma
+             * sampling, which can't be changed in the coefficient domain, and
+             * carries no markers, like a stripped image
+             */
+            unsigned char *buf = jpegq_encode(jq, st.qmax, &res->size);
+            jpegq_close(jq);
+            if (buf)
+            {
+                res->blob = magick_blob(buf, res->size);
+            }
+        }
 
-        MagickWriteImages(mw, tmpfile, MagickTrue);
-        (void) DestroyMagickWand(tmp);
-        tmp = NewMagickWand();
-        MagickReadImage(tmp, tmpfile);
+        if (!res->blob)
+        {
+            /* the search usually encoded the winner already */
+            if (!st.blob)
+            {
+                st.blob = encode_blob(mw, enc, st.qmax, &st.size);
+                st.colors = 0;
+            }
+            res->blob = st.blob;
+            res->size = st.size;
+            res->colors = st.colors;
+        }
+        res->quality = st.qmax;
+        jpegenc_close(enc);
 
         exception = DestroyExceptionInfo(exception);
     }
-
-    return tmp;
 }
 
 struct filesize
@@ -501,6 +1682,17 @@ int imgmin_options_init(struct imgmin_options *opt)
     opt->quality_out_min     = QUALITY_OUT_MIN;
     opt->quality_in_min      = QUALITY_IN_MIN;
     opt->max_steps           = MAX_STEPS;
+    opt->threads             = THREADS;
+    opt->dssim_threads       = DSSIM_THREADS;
+    opt->requantize          = REQUANTIZE;
+    opt->jpegenc             = JPEGENC;
+    opt->luma_decode         = LUMA_DECODE;
+    opt->search              = SEARCH;
+    opt->proxy_scale         = PROXY_SCALE;
+    opt->pyramid             = PYRAMID;
+    opt->early_verdict       = EARLY_VERDICT;
+    opt->compact             = COMPACT;
+    opt->stream_mp           = STREAM_MP;
     opt->show_progress       = 0;
 
     return 1;
@@ -524,21 +1716,69 @@ void imgmin_opt_set_error_threshold(
 
 #ifndef IMGMIN_LIB
 
-static unsigned char *blob_read(const char *src, size_t *size)
+/*
+ * read fd to the end into a malloc()ed buffer that starts at hint bytes and
+ * doubles as needed, so pipes of any size work and short reads don't matter
+ */
+static unsigned char *read_all(int fd, size_t hint, size_t *size)
+{
+    size_t cap = max(hint + 1, 64 * 1024);
+    size_t len = 0;
+    unsigned char *blob = malloc(cap);
+
+    for (;;)
+    {
+        ssize_t n;
+        if (!blob)
+        {
+            perror("malloc");
+            exit(1);
+        }
+        if (len == cap)
+        {
+            cap *= 2;
+            blob = realloc(blob, cap);
+            continue;
+        }
+        n = read(fd, blob + len, cap - len);
+        if (0 == n)
+            break;
+        if (n < 0)
+        {
+            if (EINTR == errno)
+                continue;
+            perror("read");
+            exit(1);
+        }
+        len += n;
+    }
+    *size = len;
+    return blob;
+}
+
+#if !defined(_WIN32) && !defined(__CYGWIN__)
+static int same_file(const struct stat *st, const char *path)
+{
+    struct stat other;
+    return strcmp("-", path) && 0 == stat(path, &other) &&
+           other.st_dev == st->st_dev && other.st_ino == st->st_ino;
+}
+#endif
+
+/*
+ * load the input image. files are mapped rather than copied, unless dst is
+ * the same file: writing it would truncate the mapping out from under us.
+ * *mapped tells blob_release() which it was
+ */
+static unsigned char *blob_read(const char *src, const char *dst, size_t *size, int *mapped)
 {
     unsigned char *blob = 0;
+    *mapped = 0;
     /* load image... */
     if (0 == strcmp("-", src))
     {
         /* ...from stdin */
-        # define BIGBUF (16 * 1024 * 1024)
-        blob = malloc(BIGBUF);
-        *size = read(STDIN_FILENO, blob, BIGBUF);
-        if (BIGBUF == *size)
-        {
-            fprintf(stderr, "Image too large for hardcoded imgmin stdin buffer\n");
-            exit(1);
-        }
+        blob = read_all(STDIN_FILENO, 0, size);
     } else {
         /* ...from disk */
         struct stat st;
@@ -548,23 +1788,54 @@ static unsigned char *blob_read(const char *src, size_t *size)
 #else
         int fd = open(src, O_RDONLY);
 #endif
+        if (-1 == fd)
+        {
+            perror("open");
+            exit(1);
+        }
         fstat(fd, &st);
-        blob = malloc(st.st_size);
-        *size = read(fd, blob, st.st_size);
+#if !defined(_WIN32) && !defined(__CYGWIN__)
+        if (S_ISREG(st.st_mode) && st.st_size > 0 && !same_file(&st, dst))
+        {
+            blob = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (MAP_FAILED != blob)
+            {
+                *size = st.st_size;
+                *mapped = 1;
+                close(fd);
+                return blob;
+            }
+        }
+#endif
+        blob = read_all(fd, st.st_size, size);
         close(fd);
     }
     return blob;
 }
 
+static void blob_release(unsigned char *blob, size_t size, int mapped)
+{
+#if !defined(_WIN32) && !defined(__CYGWIN__)
+    if (mapped)
+    {
+        munmap(blob, size);
+        return;
+    }
+#endif
+    free(blob);
+}
+
+/*
+ * write the smaller of the input and the output image to dst.
+ * blob_out is the encoded output, NULL to write the input as is; it's
+ * released here
+ */
 static size_t blob_write(
         unsigned char *blob_in, size_t size_in,
-        MagickWand *mw_out, const char *dst)
+        unsigned char *blob_out, size_t size_out,
+        const char *dst)
 {
-    /* output image... */
-    size_t size_out = (size_t)-1;
-    unsigned char *blob_out = MagickGetImageBlob(mw_out, &size_out);
-
-    if (size_out > size_in)
+    if (!blob_out || size_out > size_in)
     {
         /* results worse than original, output original input */
         (void) MagickRelinquishMemory(blob_out);
@@ -602,39 +1873,55 @@ static size_t blob_write(
     return size_out;
 }
 
-static void report_before(MagickWand *mw, size_t size_in)
+/* colors is 0 and type NULL when they weren't looked at */
+static void print_before(unsigned long q, size_t colors, size_t size_in, const char *type, const char *format)
 {
     const double ks = size_in / 1024.;
+    char buf[32] = "-";
+
+    if (colors)
+    {
+        snprintf(buf, sizeof buf, "%lu", (unsigned long)colors);
+    }
     fprintf(stdout,
-        "Before quality:%lu colors:%lu size:%5.1fkB type:%s format:%s ",
-        quality(mw),
-        (unsigned long)unique_colors(mw),
-        ks, type2str(MagickGetImageType(mw)),
-	    MagickGetImageFormat(mw));
+        "Before quality:%lu colors:%s size:%5.1fkB type:%s format:%s ",
+        q, buf, ks, type ? type : "-", format);
 }
 
-static void report_after(MagickWand *mw, size_t size_in, size_t size_out)
+/* returns the colors it counted */
+static size_t report_before(MagickWand *mw, size_t size_in)
+{
+    const size_t colors = unique_colors(mw);
+    print_before(quality(mw), colors, size_in, type2str(MagickGetImageType(mw)),
+                 MagickGetImageFormat(mw));
+    return colors;
+}
+
+/* colors is 0 when they weren't counted */
+static void report_after(unsigned long q, size_t colors, size_t size_in, size_t size_out)
 {
     const double ks = size_in / 1024.;
     const double kd = size_out / 1024.;
     const double ksave = ks - kd;
     const double kpct = ksave * 100. / ks;
+    char buf[32] = "-";
 
+    if (colors)
+    {
+        snprintf(buf, sizeof buf, "%lu", (unsigned long)colors);
+    }
     fprintf(stdout,
-        "After  quality:%lu colors:%lu size:%5.1fkB saved:%5.1fkB (%.1f%%)\n",
-        (unsigned long)quality(mw),
-        (unsigned long)unique_colors(mw),
-        kd, ksave, kpct);
+        "After  quality:%lu colors:%s size:%5.1fkB saved:%5.1fkB (%.1f%%)\n",
+        q, buf, kd, ksave, kpct);
 }
 
 static void optimize_image(MagickWand *mw, const char *src, const char *dst,
                            size_t size_in, unsigned char *blob_in,
                            const struct imgmin_options *opt)
 {
-    MagickWand *tmp;
-    size_t size_out = size_in + 1;
-
-    report_before(mw, size_in);
+    struct imgmin_result res;
+    const unsigned long q_in = quality(mw);
+    const size_t colors_in = report_before(mw, size_in);
 
 #if defined(IMGMIN_STANDALONE) && !defined(_WIN32) && !defined(__CYGWIN__)
 /*
@@ -647,14 +1934,19 @@ static void optimize_image(MagickWand *mw, const char *src, const char *dst,
         return;
     } else {
 #endif
-        tmp = search_quality(mw, dst, opt);
+        search_quality(mw, blob_in, size_in, colors_in, &res, opt);
 #if defined(IMGMIN_STANDALONE) && !defined(_WIN32) && !defined(__CYGWIN__)
     }
 #endif
 
-    size_out = blob_write(blob_in, size_in, tmp, dst);
-    report_after(tmp, size_in, size_out);
-    DestroyMagickWand(tmp);
+    if (!res.blob || res.size > size_in)
+    {
+        /* the input is written as is */
+        res.quality = q_in;
+        res.colors = colors_in;
+    }
+    report_after(res.quality, res.colors, size_in,
+                 blob_write(blob_in, size_in, res.blob, res.size, dst));
 }
 
 static void doit(const char *src, const char *dst, size_t size_in,
@@ -662,8 +1954,21 @@ static void doit(const char *src, const char *dst, size_t size_in,
 {
     MagickWand *mw;
     unsigned char *blob_in = 0;
+    int mapped;
+    struct imghdr hdr;
+
+    blob_in = blob_read(src, dst, &size_in, &mapped);
 
-    blob_in = blob_read(src, &size_in);
+    /* leave low quality JPEGs alone without decoding them; reported as search_quality() would */
+    if (imghdr_read(blob_in, size_in, &hdr) && hdr.quality &&
+        hdr.quality + QUALITY_IN_MARGIN < opt->quality_in_min)
+    {
+        print_before(hdr.quality, 0, size_in, NULL, hdr.format);
+        fprintf(stdout, " Quality < %u, won't second-guess...\n", opt->quality_in_min);
+        report_after(hdr.quality, 0, size_in, blob_write(blob_in, size_in, NULL, 0, dst));
+        blob_release(blob_in, size_in, mapped);
+        return;
+    }
 
     MagickWandGenesis();
     mw = NewMagickWand();
@@ -677,6 +1982,7 @@ static void doit(const char *src, const char *dst, size_t size_in,
     /* tear it down */
     DestroyMagickWand(mw);
     MagickWandTerminus();
+    blob_release(blob_in, size_in, mapped);
 }
 
 static void help(void)
@@ -691,6 +1997,17 @@ static void help(void)
         " --quality-out-min N      Minimum quality level for output - Default 70\n"
         " --quality-in-min N       Leave images with lower quality than this untouched - Default 82\n"
         " --max-steps N            Perform a maximum of this amount of steps - Default 5\n"
+        " --threads N              Evaluate N qualities in parallel per step (1-7) - Default 1\n"
+        " --dssim-threads N        Split each comparison across N threads (1-" xstr(DSSIM_THREADS_MAX) ") - Default 1\n"
+        " --requantize             Search JPEG qualities in the DCT coefficient domain\n"
+        " --jpegenc                Encode JPEG candidates and output with libjpeg\n"
+        " --luma-decode            Decode JPEG candidates to luma only (implies --jpegenc)\n"
+        " --search bisect|secant   How to pick the next quality to try - Default bisect\n"
+        " --proxy-scale N          Search a 1/N scale copy of large images (1, 2, 4, 8) - Default 1\n"
+        " --pyramid N              Reject candidates far over the threshold at up to N halvings of the size first (0-" xstr(PYRAMID_MAX) ") - Default 0\n"
+        " --early-verdict          Decide candidates far from the threshold from the rows compared so far\n"
+        " --compact                Keep the original's DSSIM statistics in 16 bits\n"
+        " --stream-mp N            Compare luma-only candidates of N+ megapixel images a row at a time - Default 0 (never)\n"
     );
 }
 
@@ -746,6 +2063,54 @@ static int parse_opts(int argc, char * const argv[], struct imgmin_options *opt)
             opt->max_steps = min(7, opt->max_steps);
             opt->max_steps = max(2, opt->max_steps);
             i += 2;
+        } else if (0 == strcmp("--threads", argv[i])) {
+            opt->threads = (unsigned)atoi(argv[i+1]);
+            opt->threads = min(THREADS_MAX, opt->threads);
+            opt->threads = max(1, opt->threads);
+            i += 2;
+        } else if (0 == strcmp("--dssim-threads", argv[i])) {
+            opt->dssim_threads = (unsigned)atoi(argv[i+1]);
+            opt->dssim_threads = min(DSSIM_THREADS_MAX, opt->dssim_threads);
+            opt->dssim_threads = max(1, opt->dssim_threads);
+            i += 2;
+        } else if (0 == strcmp("--requantize", argv[i])) {
+            opt->requantize = 1;
+            i++;
+        } else if (0 == strcmp("--jpegenc", argv[i])) {
+            opt->jpegenc = 1;
+            i++;
+        } else if (0 == strcmp("--luma-decode", argv[i])) {
+            opt->luma_decode = 1;
+            i++;
+        } else if (0 == strcmp("--search", argv[i])) {
+            if (argv[i+1] && 0 == strcmp("secant", argv[i+1])) {
+                opt->search = SEARCH_SECANT;
+            } else if (argv[i+1] && 0 == strcmp("bisect", argv[i+1])) {
+                opt->search = SEARCH_BISECT;
+            } else {
+                fprintf(stderr, "Unknown search '%s'\n", argv[i+1] ? argv[i+1] : "");
+                exit(1);
+            }
+            i += 2;
+        } else if (0 == strcmp("--proxy-scale", argv[i])) {
+            opt->proxy_scale = (unsigned)atoi(argv[i+1]);
+            opt->proxy_scale = opt->proxy_scale >= 8 ? 8 :
+                               opt->proxy_scale >= 4 ? 4 :
+                               opt->proxy_scale >= 2 ? 2 : 1;
+            i += 2;
+        } else if (0 == strcmp("--early-verdict", argv[i])) {
+            opt->early_verdict = 1;
+            i++;
+        } else if (0 == strcmp("--pyramid", argv[i])) {
+            opt->pyramid = (unsigned)atoi(argv[i+1]);
+            opt->pyramid = min(opt->pyramid, PYRAMID_MAX);
+            i += 2;
+        } else if (0 == strcmp("--compact", argv[i])) {
+            opt->compact = 1;
+            i++;
+        } else if (0 == strcmp("--stream-mp", argv[i])) {
+            opt->stream_mp = (unsigned)atoi(argv[i+1]);
+            i += 2;
         } else if (0 == strcmp("--help", argv[i])) {
             help();
             exit(0);
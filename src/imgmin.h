@@ -6,6 +6,10 @@
 /* ImageMagick */
 #include <wand/MagickWand.h>
 
+/* imgmin_options.search */
+#define SEARCH_BISECT   0
+#define SEARCH_SECANT   1
+
 struct imgmin_options
 {
     double   error_threshold,
@@ -15,15 +19,40 @@ struct imgmin_options
              quality_out_min,
              quality_in_min,
              max_steps,
+             threads,
+             dssim_threads,
+             requantize,
+             jpegenc,
+             luma_decode,
+             search,
+             proxy_scale,
+             pyramid,
+             early_verdict,
+             compact,
+             stream_mp,
              show_progress;
 };
 
 int imgmin_options_init(struct imgmin_options *opt);
 void imgmin_opt_set_error_threshold(struct imgmin_options *opt, const char *arg);
 
-MagickWand * search_quality(MagickWand *mw,
-                            const char *dst,
-                            const struct imgmin_options *opt);
+/*
+ * what search_quality() settled on: blob is the encoded image, to be released
+ * with MagickRelinquishMemory(), or NULL if the image was left alone.
+ * colors is 0 if the search didn't count them
+ */
+struct imgmin_result
+{
+    unsigned char *blob;
+    size_t   size;
+    unsigned quality;
+    size_t   colors;
+};
+
+void search_quality(MagickWand *mw,
+                    const unsigned char *blob, size_t size, size_t colors,
+                    struct imgmin_result *res,
+                    const struct imgmin_options *opt);
 
 #endif
 
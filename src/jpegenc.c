@@ -0,0 +1,259 @@
+/* ex: set ts=4 et: */
+/*
+ * JPEG candidate encoder
+ *
+ * The quality search encodes the same image over and over at different
+ * qualities. Going through ImageMagick for that means a copy of the whole
+ * image per candidate (setting the quality writes to the image) and one per
+ * thread (so does encoding it). This encoder works from a single packed copy
+ * of the pixels that is only ever read; each encode keeps its own libjpeg
+ * state, so any number of them can run at once.
+ *
+ * It writes what ImageMagick's JPEG writer would for a stripped image with
+ * 2x2 chroma subsampling: float DCT, optimized Huffman tables, JFIF density.
+ *
+ * The quality search only compares luma, so candidates can also be decoded
+ * straight to grayscale, which leaves out the chroma IDCTs, upsampling and
+ * color conversion of a full decode. The original's luma is then taken from
+ * the packed pixels exactly as the encoder converts them, rounding included.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+#include "jpegenc.h"
+
+/* libjpeg's RGB to Y conversion (jccolor.c) is done in 16-bit fixed point */
+#define Y_SCALEBITS 16
+#define Y_FIX(x)    ((INT32) ((x) * (1L << Y_SCALEBITS) + 0.5))
+
+struct jpegenc
+{
+    unsigned char *pixels;
+    JDIMENSION width,
+               height;
+    int components;
+    int progressive;
+    UINT8 density_unit;
+    UINT16 x_density,
+           y_density;
+};
+
+struct jpegenc_error
+{
+    struct jpeg_error_mgr pub;
+    jmp_buf jmp;
+};
+
+static void jpegenc_error_exit(j_common_ptr cinfo)
+{
+    longjmp(((struct jpegenc_error *)cinfo->err)->jmp, 1);
+}
+
+static void jpegenc_output_message(j_common_ptr cinfo)
+{
+    (void) cinfo; /* a failed encode returns NULL; stay quiet */
+}
+
+jpegenc *jpegenc_open(unsigned char *pixels, unsigned width, unsigned height, int components)
+{
+    jpegenc *je;
+
+    if (!pixels || !width || !height || (components != 1 && components != 3))
+        return NULL;
+
+    je = calloc(1, sizeof *je);
+    if (!je)
+        return NULL;
+    je->pixels = pixels;
+    je->width = width;
+    je->height = height;
+    je->components = components;
+    je->x_density = 1;
+    je->y_density = 1;
+    return je;
+}
+
+void jpegenc_close(jpegenc *je)
+{
+    if (!je)
+        return;
+    free(je->pixels);
+    free(je);
+}
+
+void jpegenc_set_density(jpegenc *je, int unit, unsigned x, unsigned y)
+{
+    if (!x || !y || x > 65535 || y > 65535)
+        return;
+    je->density_unit = (UINT8)(unit == 1 || unit == 2 ? unit : 0);
+    je->x_density = (UINT16)x;
+    je->y_density = (UINT16)y;
+}
+
+void jpegenc_set_progressive(jpegenc *je, int progressive)
+{
+    je->progressive = progressive;
+}
+
+unsigned char *jpegenc_encode(const jpegenc *je, unsigned q, size_t *size)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpegenc_error err;
+    unsigned char *out = NULL;
+    unsigned long outsize = 0;
+    const size_t stride = (size_t)je->width * je->components;
+
+    (void) jpeg_std_error(&err.pub);
+    err.pub.error_exit = jpegenc_error_exit;
+    err.pub.output_message = jpegenc_output_message;
+    cinfo.err = &err.pub;
+    if (setjmp(err.jmp))
+    {
+        jpeg_destroy_compress(&cinfo);
+        free(out);
+        return NULL;
+    }
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &out, &outsize);
+
+    cinfo.image_width = je->width;
+    cinfo.image_height = je->height;
+    cinfo.input_components = je->components;
+    cinfo.in_color_space = je->components == 3 ? JCS_RGB : JCS_GRAYSCALE;
+    jpeg_set_defaults(&cinfo); /* luma sampled 2x2 against chroma */
+    jpeg_set_quality(&cinfo, (int)q, TRUE);
+    cinfo.dct_method = JDCT_FLOAT;
+    cinfo.optimize_coding = TRUE;
+    cinfo.density_unit = je->density_unit;
+    cinfo.X_density = je->x_density;
+    cinfo.Y_density = je->y_density;
+    if (je->progressive)
+        jpeg_simple_progression(&cinfo);
+
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height)
+    {
+        JSAMPROW row = je->pixels + cinfo.next_scanline * stride;
+        (void) jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    *size = outsize;
+    return out;
+}
+
+struct jpegenc_rows
+{
+    const jpegenc *je;
+    int decoding;                   /* reading dinfo rather than je->pixels */
+    struct jpeg_decompress_struct dinfo;
+    struct jpegenc_error err;
+    JSAMPLE *row;
+};
+
+/*
+ * read the header and set up a grayscale decode; kept apart from
+ * jpegenc_luma_start() so that nothing the longjmp() may clobber lives in
+ * the same frame
+ */
+static int start_luma_decode(struct jpegenc_rows *rows, const unsigned char *blob, size_t size)
+{
+    if (setjmp(rows->err.jmp))
+        return 0;
+
+    jpeg_mem_src(&rows->dinfo, (unsigned char *)blob, (unsigned long)size);
+    (void) jpeg_read_header(&rows->dinfo, TRUE);
+    rows->dinfo.out_color_space = JCS_GRAYSCALE;
+    rows->dinfo.dct_method = JDCT_FLOAT; /* as ImageMagick decodes */
+    (void) jpeg_start_decompress(&rows->dinfo);
+    rows->row = malloc(rows->dinfo.output_width);
+    return rows->row != NULL;
+}
+
+void *jpegenc_luma_start(const jpegenc *je, const unsigned char *blob, size_t size)
+{
+    struct jpegenc_rows *rows = calloc(1, sizeof *rows);
+    if (!rows)
+        return NULL;
+    rows->je = je;
+    if (!blob)
+        return rows;
+
+    (void) jpeg_std_error(&rows->err.pub);
+    rows->err.pub.error_exit = jpegenc_error_exit;
+    rows->err.pub.output_message = jpegenc_output_message;
+    rows->dinfo.err = &rows->err.pub;
+    jpeg_create_decompress(&rows->dinfo);
+    rows->decoding = 1;
+    if (!start_luma_decode(rows, blob, size))
+    {
+        jpegenc_luma_finish(rows);
+        return NULL;
+    }
+    return rows;
+}
+
+void jpegenc_luma_finish(void *user_data)
+{
+    struct jpegenc_rows *rows = user_data;
+    if (rows->decoding)
+    {
+        /* the rest of the image may be left unread */
+        jpeg_destroy_decompress(&rows->dinfo);
+        free(rows->row);
+    }
+    free(rows);
+}
+
+/*
+ * dssim_row_callback: writes luma in [0,1].
+ * rows must be requested in order, as dssim does. rows past a decoding error
+ * come out black, so a broken candidate measures as far off
+ */
+void jpegenc_luma_row(const struct dssim_info *const inf, float *const channels[], const int num_channels, const int y, const int width, void *user_data)
+{
+    struct jpegenc_rows *rows = user_data;
+    const jpegenc *je = rows->je;
+    float *luma = channels[0];
+    int x;
+
+    (void) inf;
+    (void) num_channels;
+
+    if (!rows->decoding)
+    {
+        const JSAMPLE *src = je->pixels + (size_t)y * je->width * je->components;
+        if (je->components == 1)
+        {
+            for (x = 0; x < width; x++)
+                luma[x] = src[x] * (1.f / MAXJSAMPLE);
+        }
+        else
+        {
+            /* the 8-bit Y libjpeg's RGB to YCbCr conversion gives the encoder */
+            for (x = 0; x < width; x++)
+                luma[x] = ((Y_FIX(0.29900) * src[3*x] + Y_FIX(0.58700) * src[3*x+1] + Y_FIX(0.11400) * src[3*x+2] +
+                            (1L << (Y_SCALEBITS - 1))) >> Y_SCALEBITS) * (1.f / MAXJSAMPLE);
+        }
+        return;
+    }
+
+    /* setjmp() may only be the whole controlling expression */
+    if (setjmp(rows->err.jmp))
+    {
+        for (x = 0; x < width; x++)
+            luma[x] = 0.f;
+        return;
+    }
+    if ((JDIMENSION)y != rows->dinfo.output_scanline || jpeg_read_scanlines(&rows->dinfo, &rows->row, 1) != 1)
+    {
+        for (x = 0; x < width; x++)
+            luma[x] = 0.f;
+        return;
+    }
+    for (x = 0; x < width; x++)
+        luma[x] = rows->row[x] * (1.f / MAXJSAMPLE);
+}
@@ -0,0 +1,47 @@
+/* ex: set ts=4 et: */
+
+#ifndef JPEGENC_H
+#define JPEGENC_H
+
+#include <stddef.h>
+
+/*
+ * JPEG candidate encoder: encodes one image at any number of qualities from
+ * a single packed copy of its pixels, and reads the luma of what it encoded
+ * back for comparison.
+ */
+typedef struct jpegenc jpegenc;
+
+/*
+ * pixels are width * height packed 8-bit RGB (components = 3) or gray (1)
+ * samples, which the encoder takes ownership of and free()s on close.
+ * returns NULL on bad arguments
+ */
+jpegenc *jpegenc_open(unsigned char *pixels, unsigned width, unsigned height, int components);
+void jpegenc_close(jpegenc *je);
+
+/* JFIF density: unit 0 = aspect ratio only, 1 = dots/inch, 2 = dots/cm */
+void jpegenc_set_density(jpegenc *je, int unit, unsigned x, unsigned y);
+void jpegenc_set_progressive(jpegenc *je, int progressive);
+
+/*
+ * encode at quality q with 2x2 chroma subsampling and no markers but JFIF.
+ * only reads the encoder, so several threads may encode at once.
+ * returns a malloc()ed buffer, or NULL on failure
+ */
+unsigned char *jpegenc_encode(const jpegenc *je, unsigned q, size_t *size);
+
+struct dssim_info;
+
+/*
+ * luma of an encoded JPEG such as jpegenc_encode() returns, one row at a
+ * time, or of the encoder's own pixels when blob is NULL. blobs are decoded
+ * straight to grayscale, skipping chroma upsampling and color conversion.
+ * jpegenc_luma_row is a dssim_row_callback; start/finish bracket its user_data.
+ * start returns NULL if the blob is not a JPEG
+ */
+void *jpegenc_luma_start(const jpegenc *je, const unsigned char *blob, size_t size);
+void jpegenc_luma_finish(void *user_data);
+void jpegenc_luma_row(const struct dssim_info *const inf, float *const channels[], const int num_channels, const int y, const int width, void *user_data);
+
+#endif
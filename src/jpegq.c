@@ -0,0 +1,425 @@
+/* ex: set ts=4 et: */
+/*
+ * JPEG requantization engine
+ *
+ * Reads the quantized DCT coefficients of a JPEG once and produces each
+ * candidate quality by requantizing those coefficients directly, instead of
+ * decoding to pixels, re-encoding and decoding again. Only the luma of a
+ * candidate is reconstructed (which is all DSSIM looks at), and only the
+ * chosen quality is ever entropy-coded.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <math.h>
+#include <jpeglib.h>
+#include "jpegq.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define round_up(a, b) ((((a) + (b) - 1) / (b)) * (b))
+
+/* IJG/Annex K base tables, natural order */
+static const unsigned std_luma_qtbl[DCTSIZE2] = {
+    16,  11,  10,  16,  24,  40,  51,  61,
+    12,  12,  14,  19,  26,  58,  60,  55,
+    14,  13,  16,  24,  40,  57,  69,  56,
+    14,  17,  22,  29,  51,  87,  80,  62,
+    18,  22,  37,  56,  68, 109, 103,  77,
+    24,  35,  55,  64,  81, 104, 113,  92,
+    49,  64,  78,  87, 103, 121, 120, 101,
+    72,  92,  95,  98, 112, 100, 103,  99
+};
+
+static const unsigned std_chroma_qtbl[DCTSIZE2] = {
+    17,  18,  24,  47,  99,  99,  99,  99,
+    18,  21,  26,  66,  99,  99,  99,  99,
+    24,  26,  56,  99,  99,  99,  99,  99,
+    47,  66,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99
+};
+
+struct jpegq_error
+{
+    struct jpeg_error_mgr pub;
+    jmp_buf jmp;
+};
+
+struct jpegq
+{
+    struct jpeg_decompress_struct dinfo;
+    struct jpegq_error err;
+    jvirt_barray_ptr *coef;
+    /*
+     * row pointers into the luma coefficient array, so that readers never go
+     * through the (non thread-safe) virtual array accessor.
+     * valid because libjpeg keeps coefficient arrays entirely in memory.
+     */
+    JBLOCKROW *luma;
+    JDIMENSION luma_blocks_w,
+               luma_blocks_h;
+    UINT16 luma_qtbl[DCTSIZE2];
+    float basis[DCTSIZE][DCTSIZE];
+    int encoded;
+};
+
+/* per-reader state of jpegq_luma_row */
+struct jpegq_rows
+{
+    const jpegq *jq;
+    UINT16 qtbl[DCTSIZE2];  /* requantization target, == luma_qtbl for q=0 */
+    float *buf;             /* DCTSIZE decoded rows of luma */
+    int block_row;          /* block row currently held in buf */
+};
+
+static void jpegq_error_exit(j_common_ptr cinfo)
+{
+    longjmp(((struct jpegq_error *)cinfo->err)->jmp, 1);
+}
+
+static void jpegq_output_message(j_common_ptr cinfo)
+{
+    (void) cinfo; /* corrupt input falls back to the pixel path; stay quiet */
+}
+
+static void jpegq_error_init(struct jpegq_error *err)
+{
+    (void) jpeg_std_error(&err->pub);
+    err->pub.error_exit = jpegq_error_exit;
+    err->pub.output_message = jpegq_output_message;
+}
+
+/* same scaling as libjpeg's jpeg_set_quality(), forced to baseline */
+static void scaled_qtbl(const unsigned *base, unsigned q, UINT16 *out)
+{
+    long scale;
+    int k;
+
+    q = q < 1 ? 1 : q > 100 ? 100 : q;
+    scale = q < 50 ? 5000 / q : 200 - q * 2;
+    for (k = 0; k < DCTSIZE2; k++)
+    {
+        long v = (base[k] * scale + 50) / 100;
+        out[k] = (UINT16)(v < 1 ? 1 : v > 255 ? 255 : v);
+    }
+}
+
+/*
+ * target table for quality q: the standard table scaled to q, but never finer
+ * than the original, which would only grow the file without restoring detail
+ */
+static void requant_qtbl(const UINT16 *orig, const unsigned *base, unsigned q, UINT16 *out)
+{
+    int k;
+    scaled_qtbl(base, q, out);
+    for (k = 0; k < DCTSIZE2; k++)
+    {
+        if (out[k] < orig[k])
+            out[k] = orig[k];
+    }
+}
+
+/* map a coefficient quantized by qold onto the qnew quantizer, rounding to nearest */
+static JCOEF requantize(JCOEF c, unsigned qold, unsigned qnew)
+{
+    long v = (long)c * qold;
+    if (qold == qnew)
+        return c;
+    return (JCOEF)(v < 0 ? -((-v + qnew / 2) / qnew) : (v + qnew / 2) / qnew);
+}
+
+/*
+ * read the coefficients and cache the luma layout; kept apart from jpegq_open()
+ * so that nothing the longjmp() may clobber lives in the same frame
+ */
+static int read_coefficients(jpegq *jq, const unsigned char *blob, size_t size)
+{
+    jpeg_component_info *luma;
+    JDIMENSION by;
+
+    if (setjmp(jq->err.jmp))
+        return 0;
+
+    jpeg_mem_src(&jq->dinfo, (unsigned char *)blob, (unsigned long)size);
+    (void) jpeg_read_header(&jq->dinfo, TRUE);
+
+    /* luma must be the first, full resolution component */
+    luma = jq->dinfo.comp_info;
+    if ((jq->dinfo.jpeg_color_space != JCS_YCbCr && jq->dinfo.jpeg_color_space != JCS_GRAYSCALE) ||
+        luma->h_samp_factor != jq->dinfo.max_h_samp_factor ||
+        luma->v_samp_factor != jq->dinfo.max_v_samp_factor)
+        return 0;
+
+    jq->coef = jpeg_read_coefficients(&jq->dinfo);
+    if (!jq->coef || !luma->quant_table)
+        return 0;
+
+    memcpy(jq->luma_qtbl, luma->quant_table->quantval, sizeof jq->luma_qtbl);
+    jq->luma_blocks_w = luma->width_in_blocks;
+    jq->luma_blocks_h = luma->height_in_blocks;
+    jq->luma = malloc(jq->luma_blocks_h * sizeof *jq->luma);
+    if (!jq->luma)
+        return 0;
+    for (by = 0; by < jq->luma_blocks_h; by++)
+    {
+        jq->luma[by] = *jq->dinfo.mem->access_virt_barray(
+            (j_common_ptr)&jq->dinfo, jq->coef[0], by, 1, FALSE);
+    }
+    return 1;
+}
+
+jpegq *jpegq_open(const unsigned char *blob, size_t size)
+{
+    jpegq *jq;
+    int u, x;
+
+    if (size < 3 || blob[0] != 0xFF || blob[1] != 0xD8)
+        return NULL;
+
+    jq = calloc(1, sizeof *jq);
+    if (!jq)
+        return NULL;
+
+    jpegq_error_init(&jq->err);
+    jq->dinfo.err = &jq->err.pub;
+    jpeg_create_decompress(&jq->dinfo);
+    if (!read_coefficients(jq, blob, size))
+    {
+        jpegq_close(jq);
+        return NULL;
+    }
+
+    /* orthonormal 8-point IDCT basis: basis[x][u] */
+    for (x = 0; x < DCTSIZE; x++)
+    {
+        for (u = 0; u < DCTSIZE; u++)
+        {
+            jq->basis[x][u] = (float)((u ? sqrt(2.0 / DCTSIZE) : sqrt(1.0 / DCTSIZE)) *
+                                      cos((2 * x + 1) * u * M_PI / (2 * DCTSIZE)));
+        }
+    }
+    return jq;
+}
+
+void jpegq_close(jpegq *jq)
+{
+    if (jq)
+    {
+        jpeg_destroy_decompress(&jq->dinfo);
+        free(jq->luma);
+        free(jq);
+    }
+}
+
+unsigned jpegq_ijg_quality(const unsigned short *qtbl)
+{
+    /* the highest that matches: baseline tables clamp at 255, so low qualities can share one */
+    unsigned q;
+    int k;
+    for (q = 100; q >= 1; q--)
+    {
+        const long scale = q < 50 ? 5000 / q : 200 - q * 2;
+        for (k = 0; k < DCTSIZE2; k++)
+        {
+            long v = (std_luma_qtbl[k] * scale + 50) / 100;
+            v = v < 1 ? 1 : v > 32767 ? 32767 : v;
+            if (qtbl[k] != v && !(v > 255 && qtbl[k] == 255))
+                break;
+        }
+        if (k == DCTSIZE2)
+            return q;
+    }
+    return 0;
+}
+
+void *jpegq_luma_start(const jpegq *jq, unsigned q)
+{
+    struct jpegq_rows *rows = malloc(sizeof *rows);
+    if (!rows)
+        return NULL;
+    rows->jq = jq;
+    rows->block_row = -1;
+    rows->buf = malloc(jq->luma_blocks_w * DCTSIZE * DCTSIZE * sizeof(float));
+    if (!rows->buf)
+    {
+        free(rows);
+        return NULL;
+    }
+    if (q)
+        requant_qtbl(jq->luma_qtbl, std_luma_qtbl, q, rows->qtbl);
+    else
+        memcpy(rows->qtbl, jq->luma_qtbl, sizeof rows->qtbl);
+    return rows;
+}
+
+void jpegq_luma_finish(void *user_data)
+{
+    struct jpegq_rows *rows = user_data;
+    free(rows->buf);
+    free(rows);
+}
+
+/*
+ * requantize and inverse-transform one 8x8 block into out[y*stride + x].
+ * rows of coefficients that are entirely zero (most of them, after
+ * quantization) are skipped in both passes.
+ */
+static void idct_block(const struct jpegq_rows *rows, const JCOEF *coef, float *out, int stride)
+{
+    const jpegq *jq = rows->jq;
+    float in[DCTSIZE2];
+    float tmp[DCTSIZE][DCTSIZE];
+    int nz[DCTSIZE];
+    int nzcnt = 0;
+    int k, u, v, x, y;
+
+    for (k = 0; k < DCTSIZE2; k++)
+    {
+        in[k] = (float)requantize(coef[k], jq->luma_qtbl[k], rows->qtbl[k]) * rows->qtbl[k];
+    }
+
+    /* horizontal pass over each row of frequencies */
+    for (v = 0; v < DCTSIZE; v++)
+    {
+        const float *row = in + v * DCTSIZE;
+        for (u = 0; u < DCTSIZE && row[u] == 0.f; u++)
+            ;
+        if (u == DCTSIZE)
+            continue;
+        nz[nzcnt++] = v;
+        for (x = 0; x < DCTSIZE; x++)
+        {
+            float s = 0.f;
+            for (u = 0; u < DCTSIZE; u++)
+                s += row[u] * jq->basis[x][u];
+            tmp[v][x] = s;
+        }
+    }
+
+    /* vertical pass, plus the level shift */
+    for (y = 0; y < DCTSIZE; y++)
+    {
+        for (x = 0; x < DCTSIZE; x++)
+        {
+            float s = CENTERJSAMPLE;
+            for (k = 0; k < nzcnt; k++)
+                s += jq->basis[y][nz[k]] * tmp[nz[k]][x];
+            out[y * stride + x] = s;
+        }
+    }
+}
+
+/*
+ * dssim_row_callback: writes luma in [0,1].
+ * rows must be requested in order, as dssim does.
+ */
+void jpegq_luma_row(const struct dssim_info *const inf, float *const channels[], const int num_channels, const int y, const int width, void *user_data)
+{
+    struct jpegq_rows *rows = user_data;
+    const jpegq *jq = rows->jq;
+    const int stride = (int)jq->luma_blocks_w * DCTSIZE;
+    const float *src;
+    int x;
+
+    (void) inf;
+    (void) num_channels;
+
+    if (y / DCTSIZE != rows->block_row)
+    {
+        const JBLOCKROW blocks = jq->luma[y / DCTSIZE];
+        JDIMENSION bx;
+        for (bx = 0; bx < jq->luma_blocks_w; bx++)
+        {
+            idct_block(rows, blocks[bx], rows->buf + bx * DCTSIZE, stride);
+        }
+        rows->block_row = y / DCTSIZE;
+    }
+
+    src = rows->buf + (y % DCTSIZE) * stride;
+    for (x = 0; x < width; x++)
+    {
+        const float v = src[x] / MAXJSAMPLE;
+        channels[0][x] = v < 0.f ? 0.f : v > 1.f ? 1.f : v;
+    }
+}
+
+unsigned char *jpegq_encode(jpegq *jq, unsigned q, size_t *size)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpegq_error err;
+    unsigned char *out = NULL;
+    unsigned long outsize = 0;
+    int done[NUM_QUANT_TBLS] = { 0 };
+    int ci;
+
+    if (jq->encoded)
+        return NULL;
+    jq->encoded = 1;
+
+    jpegq_error_init(&err);
+    cinfo.err = &err.pub;
+    if (setjmp(err.jmp))
+    {
+        jpeg_destroy_compress(&cinfo);
+        free(out);
+        return NULL;
+    }
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &out, &outsize);
+    jpeg_copy_critical_parameters(&jq->dinfo, &cinfo);
+    cinfo.optimize_coding = TRUE;
+
+    /*
+     * each table is scaled from the standard table of the first component
+     * that uses it, so that luma is requantized as it was measured whichever
+     * slot it's in
+     */
+    for (ci = 0; ci < jq->dinfo.num_components; ci++)
+    {
+        const int slot = jq->dinfo.comp_info[ci].quant_tbl_no;
+        JQUANT_TBL *tbl = cinfo.quant_tbl_ptrs[slot];
+        if (tbl && !done[slot])
+        {
+            UINT16 orig[DCTSIZE2];
+            memcpy(orig, tbl->quantval, sizeof orig);
+            requant_qtbl(orig, ci ? std_chroma_qtbl : std_luma_qtbl, q, tbl->quantval);
+            done[slot] = 1;
+        }
+    }
+
+    for (ci = 0; ci < jq->dinfo.num_components; ci++)
+    {
+        const jpeg_component_info *comp = jq->dinfo.comp_info + ci;
+        const UINT16 *qold = comp->quant_table->quantval;
+        const UINT16 *qnew = cinfo.quant_tbl_ptrs[comp->quant_tbl_no]->quantval;
+        const JDIMENSION rows = round_up(comp->height_in_blocks, (JDIMENSION)comp->v_samp_factor);
+        const JDIMENSION cols = round_up(comp->width_in_blocks, (JDIMENSION)comp->h_samp_factor);
+        JDIMENSION by, bx;
+
+        for (by = 0; by < rows; by++)
+        {
+            JBLOCKROW blocks = *jq->dinfo.mem->access_virt_barray(
+                (j_common_ptr)&jq->dinfo, jq->coef[ci], by, 1, TRUE);
+            for (bx = 0; bx < cols; bx++)
+            {
+                int k;
+                for (k = 0; k < DCTSIZE2; k++)
+                    blocks[bx][k] = requantize(blocks[bx][k], qold[k], qnew[k]);
+            }
+        }
+    }
+
+    jpeg_write_coefficients(&cinfo, jq->coef);
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    *size = outsize;
+    return out;
+}
@@ -0,0 +1,42 @@
+/* ex: set ts=4 et: */
+
+#ifndef JPEGQ_H
+#define JPEGQ_H
+
+#include <stddef.h>
+
+/*
+ * JPEG requantization engine: holds the quantized DCT coefficients of a JPEG
+ * and produces candidate qualities directly in the coefficient domain.
+ */
+typedef struct jpegq jpegq;
+
+struct dssim_info;
+
+/* returns NULL if blob is not a JPEG the engine can handle */
+jpegq *jpegq_open(const unsigned char *blob, size_t size);
+void jpegq_close(jpegq *jq);
+
+/*
+ * the quality libjpeg's jpeg_set_quality() makes a luma quantization table
+ * (64 entries, natural order) with, or 0 if it isn't a scaled IJG table
+ */
+unsigned jpegq_ijg_quality(const unsigned short *qtbl);
+
+/*
+ * luma of the image requantized to quality q (0 = unchanged), one row at a time.
+ * jpegq_luma_row is a dssim_row_callback; start/finish bracket its user_data.
+ * several readers may be used concurrently from different threads.
+ */
+void *jpegq_luma_start(const jpegq *jq, unsigned q);
+void jpegq_luma_finish(void *user_data);
+void jpegq_luma_row(const struct dssim_info *const inf, float *const channels[], const int num_channels, const int y, const int width, void *user_data);
+
+/*
+ * entropy-code the whole image requantized to quality q, without any markers.
+ * requantizes in place, so it may only be called once per jpegq.
+ * returns a malloc()ed buffer, or NULL on failure
+ */
+unsigned char *jpegq_encode(jpegq *jq, unsigned q, size_t *size);
+
+#endif
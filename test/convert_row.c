@@ -0,0 +1,103 @@
+/*
+ * Times convert_row_callback() in src/imgmin.c against the PixelIterator
+ * loop it replaced, and checks both give the same luma.
+ * Run by make check, when ImageMagick is found, on the JPEGs in examples/
+ * or on the files named on its command line.
+ */
+#define IMGMIN_LIB
+#include <time.h>
+#include "../src/imgmin.c"
+#include <jpeglib.h>
+#include "testimg.h"
+
+#define REPEAT 10
+#define TOLERANCE 1e-5
+
+/* the previous convert_row_callback(), a PixelWand per pixel */
+static void iterator_row_callback(const dssim_info *const inf, float *const channels[], const int num_channels, const int y, const int orig_width, void *user_data)
+{
+    size_t x, width = orig_width;
+    PixelWand **pmw = PixelGetNextIteratorRow((PixelIterator*)user_data, &width);
+
+    for(x = 0; x < width; x++) {
+        channels[0][x] = (
+            .2126 * PixelGetRed(pmw[x]) +
+            .7152 * PixelGetGreen(pmw[x]) +
+            .0722 * PixelGetBlue(pmw[x])
+        ) * PixelGetAlpha(pmw[x]);
+    }
+}
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[])
+{
+    double iterator_time = 0, export_time = 0, worst = 0;
+    const char *const *images;
+    const int count = test_images(argc, argv, &images);
+    int i, r, y;
+    size_t x;
+
+    MagickWandGenesis();
+
+    for (i = 0; i < count; i++)
+    {
+        MagickWand *mw = NewMagickWand();
+        if (MagickReadImage(mw, images[i]) != MagickTrue)
+        {
+            ThrowWandException(mw);
+        }
+        const size_t width = MagickGetImageWidth(mw);
+        const size_t height = MagickGetImageHeight(mw);
+        float *want = malloc(width * height * sizeof(float));
+        float *got = malloc(width * height * sizeof(float));
+        double start;
+
+        start = now();
+        for (r = 0; r < REPEAT; r++)
+        {
+            PixelIterator *it = NewPixelIterator(mw);
+            for (y = 0; y < (int)height; y++)
+            {
+                float *row = want + y * width;
+                iterator_row_callback(NULL, &row, 1, y, width, it);
+            }
+            DestroyPixelIterator(it);
+        }
+        iterator_time += now() - start;
+
+        start = now();
+        for (r = 0; r < REPEAT; r++)
+        {
+            void *rows = convert_row_start(mw);
+            for (y = 0; y < (int)height; y++)
+            {
+                float *row = got + y * width;
+                convert_row_callback(NULL, &row, 1, y, width, rows);
+            }
+            convert_row_finish(rows);
+        }
+        export_time += now() - start;
+
+        for (x = 0; x < width * height; x++)
+        {
+            worst = max(worst, fabs(want[x] - got[x]));
+        }
+
+        free(want);
+        free(got);
+        DestroyMagickWand(mw);
+    }
+
+    MagickWandTerminus();
+
+    printf("PixelIterator:           %.3fs\n", iterator_time);
+    printf("MagickExportImagePixels: %.3fs\n", export_time);
+    printf("largest luma difference %g\n", worst);
+    return worst > TOLERANCE;
+}
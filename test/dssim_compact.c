@@ -0,0 +1,135 @@
+/*
+ * Benchmarks dssim_set_compact() against the default float storage: heap
+ * kept per dssim_info (the original's planes, which compact shrinks, but
+ * also the modified image and scratch space), time of comparisons and how
+ * far the scores move.
+ * Compact scores have to stay within TOLERANCE of the float ones: 2% of
+ * imgmin's default threshold (an error of 1.0 is a dssim of 0.05), which is
+ * within its ERROR_THRESHOLD_INACCURACY. Relative to small scores the change
+ * can be larger, but those are far from any threshold.
+ * Run by make check on the JPEGs in examples/, or on the files named on
+ * its command line.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <malloc.h>
+#include <jpeglib.h>
+#include "../src/dssim.h"
+#include "testimg.h"
+
+#define QUALITIES 4
+#define TOLERANCE 1e-3
+
+static unsigned char *encode(dssim_rgba **rows, int width, int height, int quality, unsigned long *size)
+{
+    struct jpeg_compress_struct c;
+    struct jpeg_error_mgr err;
+    unsigned char *blob = NULL;
+    unsigned char *line = malloc(width * 3);
+
+    *size = 0;
+    c.err = jpeg_std_error(&err);
+    jpeg_create_compress(&c);
+    jpeg_mem_dest(&c, &blob, size);
+    c.image_width = width;
+    c.image_height = height;
+    c.input_components = 3;
+    c.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&c);
+    jpeg_set_quality(&c, quality, TRUE);
+    jpeg_start_compress(&c, TRUE);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            line[3*x] = rows[y][x].r;
+            line[3*x+1] = rows[y][x].g;
+            line[3*x+2] = rows[y][x].b;
+        }
+        jpeg_write_scanlines(&c, &line, 1);
+    }
+    jpeg_finish_compress(&c);
+    jpeg_destroy_compress(&c);
+    free(line);
+    return blob;
+}
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* bytes allocated on the heap, to see what a dssim_info keeps between comparisons */
+static size_t heap_size(void)
+{
+    return mallinfo2().uordblks;
+}
+
+int main(int argc, char *argv[])
+{
+    static const int qualities[QUALITIES] = {50, 70, 80, 90};
+    double time[2] = {0}, worst = 0;
+    size_t memory[2] = {0};
+
+    const char *const *images;
+    const int count = test_images(argc, argv, &images);
+
+    for (int i = 0; i < count; i++) {
+        size_t size;
+        int width, height;
+        unsigned char *blob = slurp(images[i], &size);
+
+        if (!blob) {
+            perror(images[i]);
+            return 1;
+        }
+
+        dssim_rgba **orig = decode(blob, size, &width, &height);
+        dssim_rgba **mod[QUALITIES];
+        for (int q = 0; q < QUALITIES; q++) {
+            unsigned long jpeg_size;
+            unsigned char *jpeg = encode(orig, width, height, qualities[q], &jpeg_size);
+            int w, h;
+            mod[q] = decode(jpeg, jpeg_size, &w, &h);
+            free(jpeg);
+        }
+
+        for (int channels = 1; channels <= 3; channels += 2) {
+            double dssim[2][QUALITIES];
+
+            for (int compact = 0; compact < 2; compact++) {
+                const size_t heap = heap_size();
+                dssim_info *inf = dssim_init(channels);
+                dssim_set_compact(inf, compact);
+                dssim_set_original(inf, orig, width, height, 0.45455);
+
+                const double start = now();
+                for (int q = 0; q < QUALITIES; q++) {
+                    dssim_set_modified(inf, mod[q], width, height, 0.45455);
+                    dssim[compact][q] = dssim_compare(inf, NULL);
+                }
+                time[compact] += now() - start;
+                memory[compact] += heap_size() - heap;
+                dssim_dealloc(inf);
+            }
+
+            for (int q = 0; q < QUALITIES; q++) {
+                worst = fmax(worst, fabs(dssim[1][q] - dssim[0][q]));
+            }
+        }
+
+        for (int q = 0; q < QUALITIES; q++) {
+            free_rows(mod[q], height);
+        }
+        free_rows(orig, height);
+        free(blob);
+    }
+
+    printf("float:   %7.1f MB kept, %.3fs comparing\n", memory[0] / 1e6, time[0]);
+    printf("compact: %7.1f MB kept, %.3fs comparing\n", memory[1] / 1e6, time[1]);
+    printf("largest dssim difference %g (tolerance %g) %s\n", worst, TOLERANCE, worst > TOLERANCE ? "FAIL" : "ok");
+    return worst > TOLERANCE;
+}
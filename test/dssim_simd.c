@@ -0,0 +1,95 @@
+/*
+ * Checks that the SIMD blur, SSIM and Lab conversion kernels in src/dssim.c
+ * give the same scores as the scalar ones, picking each set the CPU runs
+ * with dssim_set_kernels(). The blurs and SSIM sums are checked on rows
+ * converted by the test, to within TOLERANCE. Through dssim's own Lab
+ * conversion, whose SIMD versions differ from the scalar one by up to 1e-5,
+ * the slightly distorted images' scores move by up to 1e-3 relative, so
+ * that's checked to within LAB_TOLERANCE.
+ * Run by make check on the JPEGs in examples/, or on the files named on
+ * its command line.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <jpeglib.h>
+#include "../src/dssim.h"
+#include "testimg.h"
+
+#define TOLERANCE 1e-5
+#define LAB_TOLERANCE 2e-3
+
+static const struct {
+    const char *name;
+    int kernels;
+} simd[] = {
+    {"sse2", DSSIM_KERNELS_SSE2},
+    {"avx2", DSSIM_KERNELS_AVX2},
+};
+
+static double compare(dssim_rgba **a, dssim_rgba **b, int width, int height, int channels, int lab)
+{
+    dssim_info *inf = dssim_init(channels);
+    if (lab) {
+        dssim_set_original(inf, a, width, height, 0.45455);
+        dssim_set_modified(inf, b, width, height, 0.45455);
+    } else {
+        dssim_set_original_float_callback(inf, width, height, rgba_row, a);
+        dssim_set_modified_float_callback(inf, width, height, rgba_row, b);
+    }
+    const double dssim = dssim_compare(inf, NULL);
+    dssim_dealloc(inf);
+    return dssim;
+}
+
+int main(int argc, char *argv[])
+{
+    int failed = 0;
+    const char *const *images;
+    const int count = test_images(argc, argv, &images);
+
+    for (int i = 0; i < count; i++) {
+        size_t size;
+        int width, height, ok = 1;
+        unsigned char *blob = slurp(images[i], &size);
+
+        if (!blob) {
+            perror(images[i]);
+            return 1;
+        }
+        printf("test %s ", images[i]);
+
+        dssim_rgba **orig = decode(blob, size, &width, &height);
+        dssim_rgba **mod = distort(orig, width, height);
+
+        for (int channels = 1; channels <= 3; channels += 2) {
+            for (int lab = 0; lab < 2; lab++) {
+                const double tolerance = lab ? LAB_TOLERANCE : TOLERANCE;
+                dssim_set_kernels(DSSIM_KERNELS_SCALAR);
+                const double want = compare(orig, mod, width, height, channels, lab);
+
+                for (size_t k = 0; k < sizeof(simd) / sizeof(simd[0]); k++) {
+                    if (!dssim_set_kernels(simd[k].kernels)) {
+                        continue;
+                    }
+                    const double got = compare(orig, mod, width, height, channels, lab);
+                    if (fabs(want - got) > tolerance * fmax(want, 1e-3)) {
+                        printf("%s %d-channel%s dssim %g, scalar %g ",
+                               simd[k].name, channels, lab ? " Lab" : "", got, want);
+                        ok = 0;
+                    }
+                }
+            }
+        }
+        dssim_set_kernels(DSSIM_KERNELS_BEST);
+
+        puts(ok ? "ok" : "FAIL");
+        failed |= !ok;
+
+        free_rows(orig, height);
+        free_rows(mod, height);
+        free(blob);
+    }
+    return failed;
+}
@@ -0,0 +1,80 @@
+/*
+ * Checks that dssim_compare_stream() agrees with dssim_compare() on the
+ * example images, for luma only and with chroma, to within TOLERANCE
+ * relative, or relative to THRESHOLD for smaller scores. Only the float
+ * rounding of the blurs' sums differs. On flat images that rounding is a
+ * larger part of a small score: color_quads' 3-channel one moves by 2.9e-3
+ * of its 0.009, but that's 5e-4 of THRESHOLD, the dssim of imgmin's default
+ * error threshold. Scores above it move by up to 4.9e-4 here.
+ * Run by make check on the JPEGs in examples/, or on the files named on
+ * its command line.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <jpeglib.h>
+#include "../src/dssim.h"
+#include "testimg.h"
+
+#define TOLERANCE 2e-3
+#define THRESHOLD 0.05
+
+static double compare(dssim_rgba **a, dssim_rgba **b, int width, int height, int channels)
+{
+    dssim_info *inf = dssim_init(channels);
+    dssim_set_original_float_callback(inf, width, height, rgba_row, a);
+    dssim_set_modified_float_callback(inf, width, height, rgba_row, b);
+    const double dssim = dssim_compare(inf, NULL);
+    dssim_dealloc(inf);
+    return dssim;
+}
+
+static double compare_stream(dssim_rgba **a, dssim_rgba **b, int width, int height, int channels)
+{
+    dssim_info *inf = dssim_init(channels);
+    const double dssim = dssim_compare_stream(inf, width, height, rgba_row, a, rgba_row, b);
+    dssim_dealloc(inf);
+    return dssim;
+}
+
+int main(int argc, char *argv[])
+{
+    int failed = 0;
+    const char *const *images;
+    const int count = test_images(argc, argv, &images);
+
+    for (int i = 0; i < count; i++) {
+        size_t size;
+        int width, height, ok = 1;
+        unsigned char *blob = slurp(images[i], &size);
+
+        if (!blob) {
+            perror(images[i]);
+            return 1;
+        }
+        printf("test %s ", images[i]);
+
+        dssim_rgba **orig = decode(blob, size, &width, &height);
+        dssim_rgba **mod = distort(orig, width, height);
+
+        for (int channels = 1; channels <= 3; channels += 2) {
+            const double want = compare(orig, mod, width, height, channels);
+            const double got = compare_stream(orig, mod, width, height, channels);
+
+            printf("%d-channel %+.1e ", channels, (got - want) / want);
+            if (fabs(got - want) > TOLERANCE * fmax(want, THRESHOLD)) {
+                printf("(dssim %g, streamed %g) ", want, got);
+                ok = 0;
+            }
+        }
+
+        puts(ok ? "ok" : "FAIL");
+        failed |= !ok;
+
+        free_rows(orig, height);
+        free_rows(mod, height);
+        free(blob);
+    }
+    return failed;
+}
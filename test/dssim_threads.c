@@ -0,0 +1,106 @@
+/*
+ * Checks that dssim_compare() and dssim_compare_band() give exactly the same
+ * scores whatever dssim_set_threads() is given, including on clones and on
+ * pyramid levels, and that the same threads serve comparison after comparison.
+ * Once every band is compared, dssim_band_estimate() must be the score too,
+ * over all of the image.
+ * Run by make check on the JPEGs in examples/, or on the files named on
+ * its command line.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <jpeglib.h>
+#include "../src/dssim.h"
+#include "testimg.h"
+
+#define REPEAT 4
+
+struct scores {
+    double full, banded, estimate, level, clone;
+};
+
+static void measure(dssim_rgba **orig, dssim_rgba **mod, int width, int height,
+                    int channels, int threads, struct scores *s)
+{
+    dssim_info *inf = dssim_init(channels);
+    double lo, hi, compared;
+
+    dssim_set_threads(inf, threads);
+    dssim_set_pyramid(inf, 1);
+    dssim_set_original(inf, orig, width, height, 0.45455);
+
+    for (int i = 0; i < REPEAT; i++) {
+        dssim_set_modified(inf, mod, width, height, 0.45455);
+        s->full = dssim_compare(inf, NULL);
+    }
+
+    dssim_set_modified(inf, mod, width, height, 0.45455);
+    while (dssim_compare_band(inf, &lo, &hi)) {
+    }
+    s->banded = lo;
+    s->estimate = dssim_band_estimate(inf, &compared);
+    if (compared != 1.0) {
+        s->estimate = -1;
+    }
+    s->level = dssim_pyramid_levels(inf) ? dssim_compare_level(inf, 1) : 0;
+
+    dssim_info *copy = dssim_clone(inf);
+    dssim_set_modified(copy, mod, width, height, 0.45455);
+    s->clone = dssim_compare(copy, NULL);
+
+    dssim_dealloc(copy);
+    dssim_dealloc(inf);
+}
+
+int main(int argc, char *argv[])
+{
+    static const int threads[] = {1, 2, 3, 8};
+    const int n = sizeof(threads) / sizeof(threads[0]);
+    int failed = 0;
+    const char *const *images;
+    const int count = test_images(argc, argv, &images);
+
+    for (int i = 0; i < count; i++) {
+        size_t size;
+        int width, height, ok = 1;
+        unsigned char *blob = slurp(images[i], &size);
+
+        if (!blob) {
+            perror(images[i]);
+            return 1;
+        }
+        printf("test %s ", images[i]);
+
+        dssim_rgba **orig = decode(blob, size, &width, &height);
+        dssim_rgba **mod = distort(orig, width, height);
+
+        for (int channels = 1; channels <= 3; channels += 2) {
+            struct scores want, got;
+
+            measure(orig, mod, width, height, channels, threads[0], &want);
+            if (want.banded != want.full || want.estimate != want.full || want.clone != want.full) {
+                printf("%d-channel dssim %g, banded %g, estimate %g, clone %g ",
+                       channels, want.full, want.banded, want.estimate, want.clone);
+                ok = 0;
+            }
+            for (int t = 1; t < n; t++) {
+                measure(orig, mod, width, height, channels, threads[t], &got);
+                if (memcmp(&want, &got, sizeof(want))) {
+                    printf("%d-channel dssim %g/%g/%g/%g with %d threads, %g/%g/%g/%g with 1 ",
+                           channels, got.full, got.banded, got.level, got.clone, threads[t],
+                           want.full, want.banded, want.level, want.clone);
+                    ok = 0;
+                }
+            }
+        }
+
+        puts(ok ? "ok" : "FAIL");
+        failed |= !ok;
+
+        free_rows(orig, height);
+        free_rows(mod, height);
+        free(blob);
+    }
+    return failed;
+}
@@ -0,0 +1,182 @@
+/*
+ * Replays the default bisection with and without --proxy-scale 2 and 4 on
+ * each image's error curves, and reports the quality each settles on and
+ * how many full-size steps it took: the proxy's answer q is confirmed by
+ * probing q and q-1 at full size, and whatever range is left is bisected,
+ * all within the same MAX_STEPS as a search without a proxy.
+ * Candidates go through src/jpegenc.c and are measured on luma, as with
+ * --luma-decode; proxies are decoded with libjpeg's DCT scaling, as
+ * proxy_image() does for JPEGs.
+ * Run by make check on the JPEGs in examples/, or on the files named on
+ * its command line.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <jpeglib.h>
+#include "../src/jpegenc.h"
+#include "../src/dssim.h"
+#include "testimg.h"
+
+#define QMIN 60
+#define QMAX 92
+#define PROXY_MIN_SIZE 256
+
+/* packed RGB, scaled down by 1/denom */
+static unsigned char *decode_scaled(const unsigned char *blob, size_t size, int denom, int *width, int *height)
+{
+    struct jpeg_decompress_struct d;
+    struct jpeg_error_mgr err;
+
+    d.err = jpeg_std_error(&err);
+    jpeg_create_decompress(&d);
+    jpeg_mem_src(&d, (unsigned char *)blob, size);
+    jpeg_read_header(&d, TRUE);
+    d.out_color_space = JCS_RGB;
+    d.scale_num = 1;
+    d.scale_denom = denom;
+    jpeg_start_decompress(&d);
+
+    *width = d.output_width;
+    *height = d.output_height;
+    unsigned char *pixels = malloc((size_t)*width * *height * 3);
+    while (d.output_scanline < d.output_height) {
+        unsigned char *row = pixels + (size_t)d.output_scanline * *width * 3;
+        jpeg_read_scanlines(&d, &row, 1);
+    }
+    jpeg_finish_decompress(&d);
+    jpeg_destroy_decompress(&d);
+    return pixels;
+}
+
+/* the error imgmin measures at every quality in [QMIN, QMAX]; pixels are freed */
+static void error_curve(unsigned char *pixels, int width, int height, double err[])
+{
+    jpegenc *je = jpegenc_open(pixels, width, height, 3);
+    dssim_info *inf = dssim_init(1);
+
+    void *rows = jpegenc_luma_start(je, NULL, 0);
+    dssim_set_original_float_callback(inf, width, height, jpegenc_luma_row, rows);
+    jpegenc_luma_finish(rows);
+
+    for (int q = QMIN; q <= QMAX; q++) {
+        size_t size;
+        unsigned char *blob = jpegenc_encode(je, q, &size);
+        rows = jpegenc_luma_start(je, blob, size);
+        dssim_set_modified_float_callback(inf, width, height, jpegenc_luma_row, rows);
+        jpegenc_luma_finish(rows);
+        err[q] = dssim_compare(inf, NULL) * 20.0;
+        free(blob);
+    }
+    dssim_dealloc(inf);
+    jpegenc_close(je);
+}
+
+/* search_state/plan_round()/finish_round() in src/imgmin.c, one candidate per round (bisect) */
+struct search {
+    int qmin, qmax;
+    int seeds[2], nseeds;
+    int rounds;
+};
+
+#define MAX_STEPS 5
+#define INACCURACY 0.03
+
+static void search(struct search *st, const double err[], double threshold, int max_rounds)
+{
+    int rounds = 0;
+
+    while (st->qmax > st->qmin + 1 && rounds < max_rounds) {
+        int q = 0;
+        while (st->nseeds > 0 && !q) {
+            const int seed = st->seeds[--st->nseeds];
+            if (seed > st->qmin && seed < st->qmax) {
+                q = seed;
+            }
+        }
+        if (!q) {
+            q = st->qmin + (st->qmax - st->qmin) / 2;
+        }
+        rounds++;
+
+        const int done = fabs(err[q] - threshold) < threshold * INACCURACY;
+        if (done || err[q] <= threshold) {
+            st->qmax = q;
+        } else {
+            st->qmin = q;
+        }
+        if (done) {
+            break;
+        }
+    }
+    st->rounds += rounds;
+}
+
+int main(int argc, char *argv[])
+{
+    const double thresholds[] = {1.0, 0.5};
+    int total_base = 0, total_full[2] = {0}, total_proxy[2] = {0}, total_dq[2] = {0};
+    const char *const *images;
+    const int count = test_images(argc, argv, &images);
+
+    for (int i = 0; i < count; i++) {
+        double full[QMAX + 1], proxy[2][QMAX + 1];
+        int width, height;
+        size_t size;
+        unsigned char *blob = slurp(images[i], &size);
+
+        if (!blob) {
+            perror(images[i]);
+            return 1;
+        }
+
+        unsigned char *pixels = decode_scaled(blob, size, 1, &width, &height);
+        error_curve(pixels, width, height, full);
+        for (int s = 0; s < 2; s++) {
+            int w, h;
+            pixels = decode_scaled(blob, size, 2 << s, &w, &h);
+            error_curve(pixels, w, h, proxy[s]);
+        }
+
+        printf("%s %dx%d\n", images[i], width, height);
+        for (int t = 0; t < 2; t++) {
+            struct search base = {QMIN, QMAX, {0}, 0, 0};
+            search(&base, full, thresholds[t], MAX_STEPS);
+            total_base += base.rounds;
+            printf("  threshold %.2f: full %d in %d steps", thresholds[t], base.qmax, base.rounds);
+
+            for (int s = 0; s < 2; s++) {
+                const int scale = 2 << s;
+                struct search st = {QMIN, QMAX, {0}, 0, 0};
+                int proxy_rounds = 0;
+
+                /* proxy_image() leaves images alone whose proxy would be under 256 pixels on a side */
+                if ((width < height ? width : height) / scale >= PROXY_MIN_SIZE) {
+                    struct search pst = st;
+                    search(&pst, proxy[s], thresholds[t], MAX_STEPS);
+                    proxy_rounds = pst.rounds;
+                    st.seeds[st.nseeds++] = pst.qmax - 1;
+                    st.seeds[st.nseeds++] = pst.qmax;
+                    printf(", 1/%d: proxy %d,", scale, pst.qmax);
+                } else {
+                    printf(", 1/%d: no proxy,", scale);
+                }
+                search(&st, full, thresholds[t], MAX_STEPS);
+                printf(" full %d in %d+%d steps", st.qmax, st.rounds, proxy_rounds);
+                total_full[s] += st.rounds;
+                total_proxy[s] += proxy_rounds;
+                total_dq[s] += st.qmax - base.qmax;
+            }
+            printf("\n");
+        }
+        free(blob);
+    }
+
+    printf("full-size steps: %d without a proxy", total_base);
+    for (int s = 0; s < 2; s++) {
+        printf(", %d at 1/%d (plus %d on the proxy, answers %+d overall)",
+               total_full[s], 2 << s, total_proxy[s], total_dq[s]);
+    }
+    printf("\n");
+    return 0;
+}
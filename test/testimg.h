@@ -0,0 +1,138 @@
+/*
+ * Image helpers shared by the test programs: the images to run on, reading a
+ * file, decoding a JPEG into dssim_rgba rows, making a distorted copy to
+ * compare against and converting rows for the float callbacks. Include after
+ * src/dssim.h and <jpeglib.h>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+/* set by test/Makefile.am, so make check finds them from any build directory */
+#ifndef EXAMPLES
+#define EXAMPLES "../examples/"
+#endif
+
+/* the JPEGs in examples/, without the -after ones */
+static const char *const examples[] = {
+    EXAMPLES "Afghan-Girl-by-Steve-McCurry.jpg",
+    EXAMPLES "Blue-Marble.jpg",
+    EXAMPLES "VJ-Day-Kiss-Jorgensen.jpg",
+    EXAMPLES "africa-dream-safaris.jpg",
+    EXAMPLES "codecs.onerivermedia.com/color_quads.jpg",
+    EXAMPLES "codecs.onerivermedia.com/source.jpg",
+    EXAMPLES "gradient-linear.jpg",
+    EXAMPLES "imgur.com/FpcZHb.jpg",
+    EXAMPLES "lena1.jpg",
+    EXAMPLES "parrot-red-color-bird.jpg",
+};
+
+/* the images named on the command line, or else the examples */
+static inline int test_images(int argc, char *argv[], const char *const **images)
+{
+    if (argc > 1) {
+        *images = (const char *const *)argv + 1;
+        return argc - 1;
+    }
+    *images = examples;
+    return sizeof(examples) / sizeof(examples[0]);
+}
+
+static inline unsigned char *slurp(const char *path, size_t *size)
+{
+    FILE *f = fopen(path, "rb");
+    unsigned char *buf;
+    long len;
+
+    if (!f) {
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    rewind(f);
+    buf = malloc(len);
+    *size = fread(buf, 1, len, f);
+    fclose(f);
+    return buf;
+}
+
+static inline dssim_rgba **decode(const unsigned char *blob, size_t size, int *width, int *height)
+{
+    struct jpeg_decompress_struct d;
+    struct jpeg_error_mgr err;
+
+    d.err = jpeg_std_error(&err);
+    jpeg_create_decompress(&d);
+    jpeg_mem_src(&d, (unsigned char *)blob, size);
+    jpeg_read_header(&d, TRUE);
+    d.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&d);
+
+    *width = d.output_width;
+    *height = d.output_height;
+    dssim_rgba **rows = malloc(*height * sizeof *rows);
+    unsigned char *line = malloc(*width * 3);
+    for (int y = 0; y < *height; y++) {
+        rows[y] = malloc(*width * sizeof(dssim_rgba));
+        jpeg_read_scanlines(&d, &line, 1);
+        for (int x = 0; x < *width; x++) {
+            rows[y][x] = (dssim_rgba){line[3*x], line[3*x+1], line[3*x+2], 255};
+        }
+    }
+    free(line);
+    jpeg_finish_decompress(&d);
+    jpeg_destroy_decompress(&d);
+    return rows;
+}
+
+/* a deterministic distortion of the image to compare it against */
+static inline dssim_rgba **distort(dssim_rgba **rows, int width, int height)
+{
+    dssim_rgba **out = malloc(height * sizeof *out);
+    for (int y = 0; y < height; y++) {
+        out[y] = malloc(width * sizeof(dssim_rgba));
+        for (int x = 0; x < width; x++) {
+            const dssim_rgba px = rows[y][(x / 4) * 4];
+            out[y][x] = (dssim_rgba){px.r ^ (x & 3), px.g, px.b ^ (y & 7), 255};
+        }
+    }
+    return out;
+}
+
+static inline void free_rows(dssim_rgba **rows, int height)
+{
+    for (int y = 0; y < height; y++) {
+        free(rows[y]);
+    }
+    free(rows);
+}
+
+/* the cube root of Lab, linear near 0 */
+static inline double lab_f(double t)
+{
+    return t > 216.0 / 24389.0 ? cbrt(t) - 16.0 / 116 : 24389.0 / 27 / 116 * t;
+}
+
+/*
+ * dssim_row_callback for dssim_rgba rows: the Lab dssim_set_original()
+ * converts to, scaled to 0..1, but computed here in doubles so it doesn't
+ * depend on dssim's own conversion kernels
+ */
+static inline void rgba_row(const dssim_info *const inf, float *const channels[], const int num_channels, const int y, const int width, void *user_data)
+{
+    const dssim_rgba *row = ((dssim_rgba **)user_data)[y];
+    (void)inf;
+
+    for (int x = 0; x < width; x++) {
+        const double r = pow(row[x].r / 255.0, 2.2), g = pow(row[x].g / 255.0, 2.2), b = pow(row[x].b / 255.0, 2.2);
+        const double X = lab_f((r * 0.4124 + g * 0.3576 + b * 0.1805) / 0.9505);
+        const double Y = lab_f(r * 0.2126 + g * 0.7152 + b * 0.0722);
+        const double Z = lab_f((r * 0.0193 + g * 0.1192 + b * 0.9505) / 1.089);
+
+        channels[0][x] = Y * 1.16;
+        if (num_channels == 3) {
+            channels[1][x] = 86.2 / 220 + 500.0 / 220 * (X - Y);
+            channels[2][x] = 107.9 / 220 + 200.0 / 220 * (Y - Z);
+        }
+    }
+}